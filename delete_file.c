@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_trace.h"
 
 int main(int argc, char *argv[]) {
     //Offset for moving through the bytes of information.  Since the superblock is always the first 32 bytes, the offset is 32
@@ -10,6 +13,9 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    qfs_trace_t trace;
+    qfs_trace_begin(&trace);
+
     FILE *fp = fopen(argv[1], "rb+");
     if (!fp) {
         perror("fopen");
@@ -33,6 +39,9 @@ int main(int argc, char *argv[]) {
 	fseek(fp, 32, SEEK_SET);
     uint16_t nextBlock;
     uint32_t blocksToDelete;
+    uint32_t fileSize;
+    uint8_t packed;
+    uint16_t entryIndex;
     uint8_t buffer[32] = {0};
     uint8_t openByte = 0x00;
 	uint8_t found = 0;
@@ -45,23 +54,48 @@ int main(int argc, char *argv[]) {
 		//read the directory entry at the current position
 		fread(&currentEntry, sizeof(direntry_t), 1, fp);
 		
-		//check if the directory entry is the requested file
-		if(strcmp(currentEntry.filename, argv[2]) == 0)
+		//check if the directory entry is the requested file, and not one still being written
+		if(strcmp(currentEntry.filename, argv[2]) == 0 &&
+		   !(currentEntry.permissions & QFS_PERM_PENDING))
 		{
+            //lock the entry and make sure nobody removed it in the meantime
+            qfs_lock(fp, 32 + (32*i), 32, F_WRLCK, 1);
+            fseek(fp, 32 + (32*i), SEEK_SET);
+            fread(&currentEntry, sizeof(direntry_t), 1, fp);
+            if(strcmp(currentEntry.filename, argv[2]) != 0 ||
+               (currentEntry.permissions & QFS_PERM_PENDING))
+            {
+                break;
+            }
+
 			//save the starting block and the number of blocks to open up
 			nextBlock = currentEntry.starting_block;
-            blocksToDelete = currentEntry.file_size;
+            fileSize = currentEntry.file_size;
+            packed = (currentEntry.permissions & QFS_PERM_TAIL) != 0;
+            entryIndex = i;
 			found = 1;
-
-            //overwrite the directory entry with 0's to mark as empty
-            fseek(fp,32 + (32*i), SEEK_SET);
-            fwrite(&buffer, 1, sizeof(uint8_t) * 32, fp);
-
-            //empty original directory entry :D
 			break;
 		}
 	}
 
+    //past the full table, look in the hashed directory. Its lock is held until the
+    //end, and its entries tag their tail fragments with a hash of the name
+    qfs_dir_t dir;
+    uint8_t hashed = 0;
+    if (!found && (sb.flags & QFS_SB_HASHED_DIR) && qfs_dir_open(&dir, fp, &sb) == 0) {
+        if (qfs_dir_lock(&dir, F_WRLCK) == 0 && qfs_dir_lookup(&dir, argv[2], &currentEntry) > 0 &&
+            !(currentEntry.permissions & QFS_PERM_PENDING)) {
+            nextBlock = currentEntry.starting_block;
+            fileSize = currentEntry.file_size;
+            packed = (currentEntry.permissions & QFS_PERM_TAIL) != 0;
+            entryIndex = qfs_name_tag(currentEntry.filename);
+            found = 1;
+            hashed = 1;
+        } else {
+            qfs_dir_unlock(&dir);
+            qfs_dir_close(&dir);
+        }
+    }
     
     //prints error message and terminates program if file not found
 	if(!found)
@@ -70,27 +104,112 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-    //iterate through each block within the file, setting the first byte of each to 0x00, or open
+    //a packed file's final partial block lives in a shared tail block
+    uint32_t dataSize = blockSize - 3;
+    blocksToDelete = qfs_chain_blocks(fileSize, dataSize, packed);
+
+    //walk the chain first, these blocks are ours so no lock is needed to read them
+    uint16_t *chain = malloc(sizeof(uint16_t) * (blocksToDelete + 1));
     for(int i = 0; i < blocksToDelete; i++){
-        //open block
-        fseek(fp,blockStartIndex + (nextBlock* blockSize), SEEK_SET);
-        fwrite(&openByte, 1, sizeof(uint8_t), fp);
+        chain[i] = nextBlock;
 
         //read in the next block
         fseek(fp, blockStartIndex + (((nextBlock + 1) * blockSize)) - 2, SEEK_SET);
         fread(&nextBlock, sizeof(uint16_t), 1, fp);
     }
-    
+    chain[blocksToDelete] = nextBlock;
+
+    //lock every allocation group the file has blocks in, in ascending order
+    uint32_t groupSize = qfs_group_size(&sb);
+    uint32_t groupCount = qfs_group_count(&sb);
+    uint16_t *freed = calloc(groupCount, sizeof(uint16_t));
+    uint8_t *locked = calloc(groupCount, 1);
+    for(int i = 0; i < blocksToDelete + packed; i++){
+        locked[chain[i] / groupSize] = 1;
+    }
+    for(uint32_t g = 0; g < groupCount; g++){
+        if(locked[g]) qfs_lock_group(fp, &sb, g, F_WRLCK, 1);
+    }
 
-    //update the number of available blocks and entries, overwrite existing superblock on-file
+    //iterate through each block within the file, setting the first byte of each to 0x00, or open
+    for(int i = 0; i < blocksToDelete; i++){
+        //open block
+        fseek(fp,blockStartIndex + (chain[i]* blockSize), SEEK_SET);
+        fwrite(&openByte, 1, sizeof(uint8_t), fp);
+        freed[chain[i] / groupSize]++;
+    }
+
+
+    //after the chain, nextBlock is the tail block holding this file's fragment
+    if (packed) {
+        uint8_t *tailData = malloc(dataSize);
+        fseek(fp, blockStartIndex + (nextBlock * blockSize) + 1, SEEK_SET);
+        fread(tailData, dataSize, 1, fp);
+
+        //remove the fragment and slide the following fragments down over it
+        long fragOffset = qfs_tail_find(tailData, dataSize, entryIndex);
+        if (fragOffset >= 0) {
+            size_t used = qfs_tail_remove(tailData, dataSize, fragOffset);
+            fseek(fp, blockStartIndex + (nextBlock * blockSize) + 1, SEEK_SET);
+            fwrite(tailData, 1, dataSize, fp);
+
+            //open the tail block once its last fragment is gone
+            if (used == 0) {
+                fseek(fp, blockStartIndex + (nextBlock * blockSize), SEEK_SET);
+                fwrite(&openByte, 1, sizeof(uint8_t), fp);
+                freed[nextBlock / groupSize]++;
+                blocksToDelete++;
+            }
+        }
+        free(tailData);
+    }
+
+    //give the opened blocks back to their groups' free counts
+    for(uint32_t g = 0; g < groupCount && sb.blocks_per_group; g++){
+        if(freed[g] == 0) continue;
+        groupdesc_t desc;
+        long descOffset = blockStartIndex + ((long)g * groupSize * blockSize) + 1;
+        fseek(fp, descOffset, SEEK_SET);
+        fread(&desc, sizeof(groupdesc_t), 1, fp);
+        desc.free_blocks += freed[g];
+        fseek(fp, descOffset, SEEK_SET);
+        fwrite(&desc, sizeof(groupdesc_t), 1, fp);
+    }
+
+    //the blocks are all opened, let other tools have the groups before
+    //waiting for the superblock
+    for(uint32_t g = 0; g < groupCount; g++){
+        if(locked[g]) qfs_lock_group(fp, &sb, g, F_UNLCK, 0);
+    }
+
+    //overwrite the directory entry with 0's to mark as empty
+    if (hashed) {
+        qfs_dir_remove(&dir, argv[2]);
+        qfs_dir_close(&dir);
+    } else {
+        fseek(fp, 32 + (32*entryIndex), SEEK_SET);
+        fwrite(&buffer, 1, sizeof(uint8_t) * 32, fp);
+    }
+
+    //update the number of available blocks and entries under a short superblock lock,
+    //re-reading it since other tools may have changed the counts. Unlocking it
+    //also releases the hashed directory lock
+    qfs_lock(fp, 0, sizeof(superblock_t), F_WRLCK, 1);
+    fseek(fp, 0, SEEK_SET);
+    fread(&sb, sizeof(superblock_t), 1, fp);
     sb.available_blocks += blocksToDelete;
-    sb.available_direntries += 1;
+    if (!hashed) sb.available_direntries += 1;
     fseek(fp, 0, SEEK_SET);
     fwrite(&sb, 1, sizeof(superblock_t), fp);
+    qfs_lock(fp, 0, sizeof(superblock_t), F_UNLCK, 0);
 
     
-    //flush file for safety
+    //flush file for safety, closing it releases the entry lock
 	fflush(fp);
+    free(chain);
+    free(freed);
+    free(locked);
     fclose(fp);
+    qfs_trace_end(&trace, "delete", fileSize, argv[2]);
     return 0;
 }
@@ -5,26 +5,128 @@
  * Group: Aleena Graveline, Jean LaFrance, Horacio Valdes, Matthew Glennon
  * Updated by: Jean LaFrance
  * 12/6/2025
+ *
+ * Usage: list_information [--format=text|json|csv] [--analyze] <disk image file>
+ *
+ *   --format=json  One JSON object with superblock, files and (with --analyze) free_space
+ *   --format=csv   One row per file. With --analyze, followed by a blank line and the
+ *                  free-extent histogram, then a blank line and the free-space summary
+ *   --analyze      Walk each file's chain once and report its block count, number of
+ *                  contiguous runs and average seek distance (blocks skipped between
+ *                  consecutive blocks), plus a histogram of free-extent sizes. A file
+ *                  packed into a shared tail block is reported as packed; the jump to
+ *                  the tail block counts neither as a run nor as seek distance
  */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_kernels.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV  2
+
+// Blocks read at once when scanning the busy bytes
+#define SCAN_CHUNK 256
+
+// Free extents are bucketed by power of two: bucket b holds sizes [2^b, 2^(b+1))
+#define FREE_BUCKETS 17
+
+// Layout of a single file's block chain
+typedef struct chaininfo {
+    uint32_t blocks;               // Blocks visited, including a shared tail block
+    uint32_t runs;                 // Number of runs of consecutive block numbers
+    double   avg_seek;             // Mean blocks skipped between consecutive blocks
+    int      packed;               // Final partial block lives in a shared tail block
+} chaininfo_t;
+
+/*
+** Walks a file's chain once, following the next pointer of every block. The tail
+** block of a packed file is shared, so where it lies says nothing about how the
+** file was laid out: it is counted in `blocks` but not in `runs` or `avg_seek`.
+*/
+static chaininfo_t walk_chain(FILE *fp, long data_start, const superblock_t *sb,
+                              const direntry_t *entry) {
+    chaininfo_t info = {0, 1, 0.0, (entry->permissions & QFS_PERM_TAIL) != 0};
+    uint32_t data_size = sb->bytes_per_block - 3;
+    uint32_t chain = qfs_chain_blocks(entry->file_size, data_size, info.packed);
+
+    uint16_t block = entry->starting_block;
+    uint64_t total_seek = 0;
+    while (info.blocks < chain && block < sb->total_blocks) {
+        info.blocks++;
+        if (info.blocks == chain) break;
+
+        uint16_t next;
+        fseek(fp, data_start + ((long)(block + 1) * sb->bytes_per_block) - 2, SEEK_SET);
+        if (fread(&next, sizeof(uint16_t), 1, fp) != 1) break;
+        if (next != block + 1) {
+            info.runs++;
+            total_seek += (next > block) ? next - block - 1 : block - next + 1;
+        }
+        block = next;
+    }
+    if (info.blocks > 1) info.avg_seek = (double)total_seek / (info.blocks - 1);
+    if (info.packed) info.blocks++;
+    return info;
+}
+
+// Prints a string as a JSON string literal
+static void print_json_string(const char *str) {
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20) printf("\\u%04x", (unsigned char)*str);
+        else putchar(*str);
+    }
+    putchar('"');
+}
+
+// Prints a string as a CSV field, quoting it when needed
+static void print_csv_string(const char *str) {
+    if (!strpbrk(str, ",\"\r\n")) {
+        fputs(str, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"') putchar('"');
+        putchar(*str);
+    }
+    putchar('"');
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk image file>\n", argv[0]);
+    int format = FORMAT_TEXT;
+    int analyze = 0;
+    char *image_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--format=text") == 0) format = FORMAT_TEXT;
+        else if (strcmp(argv[i], "--format=json") == 0) format = FORMAT_JSON;
+        else if (strcmp(argv[i], "--format=csv") == 0) format = FORMAT_CSV;
+        else if (strcmp(argv[i], "--analyze") == 0) analyze = 1;
+        else if (argv[i][0] != '-' && !image_name) image_name = argv[i];
+        else {
+            image_name = NULL;
+            break;
+        }
+    }
+    if (!image_name) {
+        fprintf(stderr, "Usage: %s [--format=text|json|csv] [--analyze] <disk image file>\n", argv[0]);
         return 1;
     }
-    FILE *fp = fopen(argv[1], "rb");
+    FILE *fp = fopen(image_name, "rb");
     if (!fp) {
         perror("fopen");
         return 2;
     }
 
 #ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
+    printf("Opened disk image: %s\n", image_name);
 #endif
 
     // Read superblock
@@ -38,28 +140,86 @@ int main(int argc, char *argv[]) {
         return 3;
     }
 
+    if (superblock.bytes_per_block < 3) {
+        fprintf(stderr, "Invalid block size in superblock.\n");
+        fclose(fp);
+        return 4;
+    }
+    long data_start = sizeof(superblock_t) + (superblock.total_direntries * sizeof(direntry_t));
+
+    // Load the hashed directory index, if the table has overflowed into one
+    qfs_dir_t dir;
+    if (qfs_dir_open(&dir, fp, &superblock) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(fp);
+        return 5;
+    }
+    int hashed = (superblock.flags & QFS_SB_HASHED_DIR) != 0;
+    if (hashed && qfs_dir_lock(&dir, F_RDLCK) != 0) {
+        fprintf(stderr, "Error: Could not read the hashed directory.\n");
+        hashed = 0;
+    }
+
     // Output superblock info
-    printf("Superblock Information\n");
-    printf("Block Size: %u bytes\n", superblock.bytes_per_block);
-    printf("Total Blocks: %u\n", superblock.total_blocks);
-    printf("Free Blocks: %u\n", superblock.available_blocks);
-    printf("Total Directory Entries: %u\n", superblock.total_direntries);
-    printf("Free Directory Entries: %u\n\n", superblock.available_direntries);
-
-    // Move pointer to start
+    if (format == FORMAT_TEXT) {
+        printf("Superblock Information\n");
+        printf("Block Size: %u bytes\n", superblock.bytes_per_block);
+        printf("Total Blocks: %u\n", superblock.total_blocks);
+        printf("Free Blocks: %u\n", superblock.available_blocks);
+        printf("Total Directory Entries: %u\n", superblock.total_direntries);
+        printf("Free Directory Entries: %u\n", superblock.available_direntries);
+        if (hashed) {
+            printf("Hashed Directory Entries: %u (%u buckets)\n",
+                   dir.header.entry_count, dir.header.bucket_count);
+        }
+        printf("\n");
+    } else if (format == FORMAT_JSON) {
+        printf("{\"superblock\":{\"label\":");
+        char label[sizeof(superblock.label) + 1] = {0};
+        memcpy(label, superblock.label, sizeof(superblock.label));
+        print_json_string(label);
+        printf(",\"block_size\":%u,\"total_blocks\":%u,\"free_blocks\":%u,"
+               "\"total_direntries\":%u,\"free_direntries\":%u,\"hashed_direntries\":%u},"
+               "\"files\":[",
+               superblock.bytes_per_block, superblock.total_blocks, superblock.available_blocks,
+               superblock.total_direntries, superblock.available_direntries,
+               hashed ? dir.header.entry_count : 0);
+    } else {
+        printf("name,size,type,starting_block%s\n", analyze ? ",blocks,runs,avg_seek,packed" : "");
+    }
+
+    // Read the whole directory table, then the hashed directory's entries in
+    // bucket order, up front so chain walks can seek freely
+    size_t capacity = superblock.total_direntries + (hashed ? dir.header.entry_count : 0);
+    direntry_t *entries = calloc(capacity ? capacity : 1, sizeof(direntry_t));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(fp);
+        return 5;
+    }
     fseek(fp, sizeof(superblock_t), SEEK_SET);
+    int total_entries = fread(entries, sizeof(direntry_t), superblock.total_direntries, fp);
+    if (total_entries != superblock.total_direntries) {
+        fprintf(stderr, "Error: Could not read directory entry %d.\n", total_entries);
+    }
+    qfs_dir_iter_t iter = {0, 0};
+    while (hashed && (size_t)total_entries < capacity &&
+           qfs_dir_next(&dir, &iter, &entries[total_entries]) > 0) {
+        // Entries still being written aren't files yet
+        if (!(entries[total_entries].permissions & QFS_PERM_PENDING)) total_entries++;
+    }
+    if (hashed) qfs_dir_unlock(&dir);
+    qfs_dir_close(&dir);
 
     // Print directory information
     direntry_t direntry;
     int total_files = 0;
-    printf("Directory Entries\n");
-    for (int i = 0; i < superblock.total_direntries; i++) {
-        if (fread(&direntry, sizeof(direntry_t), 1, fp) != 1) {
-            fprintf(stderr, "Error: Could not read directory entry %d.\n", i);
-            break;
-        }
+    if (format == FORMAT_TEXT) printf("Directory Entries\n");
+    for (int i = 0; i < total_entries; i++) {
+        direntry = entries[i];
 
-        if (direntry.filename[0] != '\0') {
+        // Entries still being written aren't files yet
+        if (direntry.filename[0] != '\0' && !(direntry.permissions & QFS_PERM_PENDING)) {
             total_files++;
 
             // Bits 6:7 of permissions are file type
@@ -73,13 +233,123 @@ int main(int argc, char *argv[]) {
                 strcpy(type_name, "None");
             }
 
-            printf(">%s\n", direntry.filename);
-            printf("File Size: %u bytes\n", direntry.file_size);
-            printf("File Type: %s\n", type_name);
-            printf("Starting Block: %u\n", direntry.starting_block);
+            char name[sizeof(direntry.filename) + 1] = {0};
+            memcpy(name, direntry.filename, sizeof(direntry.filename));
+            chaininfo_t info = {0, 0, 0.0, 0};
+            if (analyze) info = walk_chain(fp, data_start, &superblock, &direntry);
+
+            if (format == FORMAT_TEXT) {
+                printf(">%s\n", name);
+                printf("File Size: %u bytes\n", direntry.file_size);
+                printf("File Type: %s\n", type_name);
+                printf("Starting Block: %u\n", direntry.starting_block);
+                if (analyze) {
+                    printf("Blocks: %u\n", info.blocks);
+                    printf("Contiguous Runs: %u\n", info.runs);
+                    printf("Average Seek Distance: %.2f blocks\n", info.avg_seek);
+                    printf("Packed Tail: %s\n", info.packed ? "Yes" : "No");
+                }
+            } else if (format == FORMAT_JSON) {
+                printf("%s{\"name\":", total_files > 1 ? "," : "");
+                print_json_string(name);
+                printf(",\"size\":%u,\"type\":\"%s\",\"starting_block\":%u",
+                       direntry.file_size, type_name, direntry.starting_block);
+                if (analyze) {
+                    printf(",\"blocks\":%u,\"runs\":%u,\"avg_seek\":%.2f,\"packed\":%s",
+                           info.blocks, info.runs, info.avg_seek, info.packed ? "true" : "false");
+                }
+                printf("}");
+            } else {
+                print_csv_string(name);
+                printf(",%u,%s,%u", direntry.file_size, type_name, direntry.starting_block);
+                if (analyze) {
+                    printf(",%u,%u,%.2f,%d", info.blocks, info.runs, info.avg_seek, info.packed);
+                }
+                printf("\n");
+            }
+        }
+    }
+    if (total_files == 0 && format == FORMAT_TEXT) printf("No files found\n");
+    if (format == FORMAT_JSON) printf("]");
+    free(entries);
+
+    if (analyze) {
+        // Read the data region in chunks, gather every busy byte once and
+        // measure the runs of free blocks
+        const qfs_kernels_t *kernels = qfs_select_kernels(superblock.bytes_per_block);
+        uint8_t *chunk = malloc((size_t)SCAN_CHUNK * superblock.bytes_per_block);
+        uint8_t busy[SCAN_CHUNK];
+        uint32_t histogram[FREE_BUCKETS] = {0};
+        uint32_t largest_run = 0, free_blocks = 0, run = 0, extents = 0;
+        uint32_t chunk_first = 0, chunk_count = 0;
+        if (!chunk) {
+            fprintf(stderr, "Memory allocation failed\n");
+            fclose(fp);
+            return 5;
+        }
+        for (uint32_t i = 0; i <= superblock.total_blocks; i++) {
+            uint8_t busy_flag = QFS_BLOCK_BUSY;
+            if (i < superblock.total_blocks) {
+                if (i >= chunk_first + chunk_count) {
+                    chunk_first = i;
+                    chunk_count = superblock.total_blocks - i < SCAN_CHUNK ?
+                                  superblock.total_blocks - i : SCAN_CHUNK;
+                    fseek(fp, data_start + ((long)i * superblock.bytes_per_block), SEEK_SET);
+                    size_t got = fread(chunk, superblock.bytes_per_block, chunk_count, fp);
+                    kernels->scan_busy(busy, chunk, got, superblock.bytes_per_block);
+                    memset(busy + got, QFS_BLOCK_BUSY, chunk_count - got);
+                }
+                busy_flag = busy[i - chunk_first];
+            }
+            if (busy_flag == QFS_BLOCK_FREE) {
+                run++;
+                free_blocks++;
+                continue;
+            }
+            if (run > 0) {
+                int bucket = 0;
+                while (bucket < FREE_BUCKETS - 1 && (run >> (bucket + 1)) != 0) bucket++;
+                histogram[bucket]++;
+                extents++;
+                if (run > largest_run) largest_run = run;
+                run = 0;
+            }
+        }
+
+        free(chunk);
+
+        if (format == FORMAT_TEXT) {
+            printf("\nFree Space\n");
+            printf("Free Blocks: %u\n", free_blocks);
+            printf("Free Extents: %u\n", extents);
+            printf("Largest Free Run: %u blocks\n", largest_run);
+            printf("Free Extent Histogram (blocks: extents)\n");
+        } else if (format == FORMAT_JSON) {
+            printf(",\"free_space\":{\"free_blocks\":%u,\"extents\":%u,"
+                   "\"largest_run\":%u,\"histogram\":[", free_blocks, extents, largest_run);
+        } else {
+            printf("\nextent_min,extent_max,count\n");
+        }
+        int first = 1;
+        for (int b = 0; b < FREE_BUCKETS; b++) {
+            if (histogram[b] == 0) continue;
+            uint32_t low = 1u << b, high = (1u << (b + 1)) - 1;
+            if (format == FORMAT_TEXT) {
+                printf("%u-%u: %u\n", low, high, histogram[b]);
+            } else if (format == FORMAT_JSON) {
+                printf("%s{\"min\":%u,\"max\":%u,\"count\":%u}", first ? "" : ",",
+                       low, high, histogram[b]);
+            } else {
+                printf("%u,%u,%u\n", low, high, histogram[b]);
+            }
+            first = 0;
+        }
+        if (format == FORMAT_JSON) printf("]}");
+        if (format == FORMAT_CSV) {
+            printf("\nfree_blocks,extents,largest_run\n%u,%u,%u\n", free_blocks, extents, largest_run);
         }
     }
-    if (total_files == 0) printf("No files found\n");
+    if (format == FORMAT_JSON) printf("}\n");
 
     fclose(fp);
     return 0;
@@ -123,7 +123,16 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Total blocks: %d\n", sb.total_blocks);
 #endif
 
-    sb.available_blocks = sb.total_blocks;
+    // Split the data region into allocation groups; the first block of each
+    // group holds the group's descriptor and is never available for data
+    sb.blocks_per_group = QFS_BLOCKS_PER_GROUP;
+    uint32_t group_count = (sb.total_blocks + sb.blocks_per_group - 1) / sb.blocks_per_group;
+
+#ifdef DEBUG
+    fprintf(stderr, "Allocation groups: %u of %u blocks\n", group_count, sb.blocks_per_group);
+#endif
+
+    sb.available_blocks = sb.total_blocks - group_count;
 
 #ifdef DEBUG
     fprintf(stderr, "Available blocks: %d\n", sb.available_blocks);
@@ -159,6 +168,17 @@ int main(int argc, char *argv[]) {
     // Move to first data block
     fseek(fp, sizeof(superblock_t) + sizeof(dir_zeros), SEEK_SET);
     for (int i = 0; i < sb.total_blocks; i++) {
+        if (i % sb.blocks_per_group == 0) {
+            // Write the group descriptor block
+            uint8_t group_flag = QFS_BLOCK_GROUP;
+            uint32_t group_blocks = sb.total_blocks - i;
+            if (group_blocks > sb.blocks_per_group) group_blocks = sb.blocks_per_group;
+            groupdesc_t desc = { (uint16_t)(group_blocks - 1) };
+            fwrite(&group_flag, 1, 1, fp);
+            fwrite(&desc, sizeof(groupdesc_t), 1, fp);
+            fseek(fp, sb.bytes_per_block - 1 - sizeof(groupdesc_t), SEEK_CUR);
+            continue;
+        }
         // Set block busy byte to zero
         fwrite(&data, 1, 1, fp);
         // Move to next block
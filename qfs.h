@@ -8,6 +8,26 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// Block header (is_busy) values
+#define QFS_BLOCK_FREE  0x00       // Block is free
+#define QFS_BLOCK_BUSY  0x01       // Block belongs to a single file's chain
+#define QFS_BLOCK_TAIL  0x02       // Block holds packed tails of several files
+#define QFS_BLOCK_GROUP 0x03       // First block of an allocation group, holds its descriptor
+#define QFS_BLOCK_DIR   0x04       // Block of the hashed directory (see qfs_dir.h)
+
+// Allocation group size used by mkfs_qfs
+#define QFS_BLOCKS_PER_GROUP 1024
+
+// Permission bits (bits 6:7 are the file type)
+#define QFS_PERM_TAIL   0x20       // File's final partial block lives in a tail block
+#define QFS_PERM_PENDING 0x10      // Hashed entry reserved by a write still in progress
+
+// Superblock flags
+#define QFS_SB_HASHED_DIR 0x01     // The image has a hashed directory at dir_index
 
 #pragma pack(push,1)
 
@@ -19,7 +39,10 @@ typedef struct superblock {
   uint16_t  bytes_per_block;       // Number of bytes per block
   uint8_t   total_direntries;      // Total number of directory entries
   uint8_t   available_direntries;  // Number of available dir entries
-  uint8_t   reserved[8];           // Reserved, all set to 0
+  uint16_t  blocks_per_group;      // Blocks per allocation group (0 = no groups)
+  uint8_t   flags;                 // QFS_SB_* flags
+  uint16_t  dir_index;             // First index block of the hashed directory
+  uint8_t   reserved[3];           // Reserved, all set to 0
   char      label[15];             // NULL-terminated volume label (optional)
 } superblock_t;
 
@@ -40,4 +63,121 @@ typedef struct fileblock {
     uint16_t next_block;           // Next block number (if applicable)
 } fileblock_t;
 
-#pragma pack(pop)
\ No newline at end of file
+// QFS Allocation Group Descriptor (start of the data area of a group's first block)
+typedef struct groupdesc {
+    uint16_t free_blocks;          // Number of free blocks in the group
+} groupdesc_t;
+
+// QFS Packed Tail Fragment Header
+// The data area of a tail block is a sequence of fragments, each one this header
+// followed by `length` bytes of file data. A header with length 0 ends the list.
+typedef struct tailfrag {
+    uint16_t owner;                // Owning directory slot, or qfs_name_tag() of a hashed entry
+    uint16_t length;               // Number of data bytes following the header
+} tailfrag_t;
+
+#pragma pack(pop)
+
+// Returns the number of bytes used by fragments in a tail block's data area
+static inline size_t qfs_tail_used(const uint8_t *data, size_t data_size) {
+    size_t pos = 0;
+    tailfrag_t frag;
+    while (pos + sizeof(tailfrag_t) <= data_size) {
+        memcpy(&frag, data + pos, sizeof(tailfrag_t));
+        if (frag.length == 0) break;
+        pos += sizeof(tailfrag_t) + frag.length;
+    }
+    return pos;
+}
+
+// Returns the offset of the fragment header owned by `owner`, or -1 if there is none
+static inline long qfs_tail_find(const uint8_t *data, size_t data_size, uint16_t owner) {
+    size_t pos = 0;
+    tailfrag_t frag;
+    while (pos + sizeof(tailfrag_t) <= data_size) {
+        memcpy(&frag, data + pos, sizeof(tailfrag_t));
+        if (frag.length == 0) break;
+        if (frag.owner == owner) return (long)pos;
+        pos += sizeof(tailfrag_t) + frag.length;
+    }
+    return -1;
+}
+
+/*
+** Removes the fragment whose header is at `offset`, sliding the fragments after
+** it down and clearing the bytes they leave behind. Returns the bytes still used.
+*/
+static inline size_t qfs_tail_remove(uint8_t *data, size_t data_size, size_t offset) {
+    tailfrag_t frag;
+    memcpy(&frag, data + offset, sizeof(tailfrag_t));
+    size_t used = qfs_tail_used(data, data_size);
+    size_t cut = sizeof(tailfrag_t) + frag.length;
+    memmove(data + offset, data + offset + cut, used - offset - cut);
+    memset(data + used - cut, 0, cut);
+    return used - cut;
+}
+
+// Bytes of a file that can be packed into a tail fragment: its final partial
+// block, if the fragment header fits beside it in one data area, otherwise 0
+static inline uint32_t qfs_tail_length(uint32_t file_size, uint32_t data_size) {
+    uint32_t tail = file_size % data_size;
+    return tail + sizeof(tailfrag_t) <= data_size ? tail : 0;
+}
+
+// Blocks of a file's own chain: one per full data area plus its final partial
+// block, unless that was packed into a tail block. An empty file owns one block.
+static inline uint32_t qfs_chain_blocks(uint32_t file_size, uint32_t data_size, int packed) {
+    if (packed) return file_size / data_size;
+    return file_size == 0 ? 1 : (file_size + data_size - 1) / data_size;
+}
+
+// Byte offset of data block 0
+static inline long qfs_data_start(const superblock_t *sb) {
+    return sizeof(superblock_t) + (sb->total_direntries * sizeof(direntry_t));
+}
+
+// Blocks per allocation group. An image without groups is a single group
+// spanning every block, with no descriptor block.
+static inline uint32_t qfs_group_size(const superblock_t *sb) {
+    return sb->blocks_per_group ? sb->blocks_per_group : sb->total_blocks;
+}
+
+static inline uint32_t qfs_group_count(const superblock_t *sb) {
+    uint32_t size = qfs_group_size(sb);
+    return size ? (sb->total_blocks + size - 1) / size : 0;
+}
+
+/*
+** Takes (F_WRLCK, F_RDLCK) or releases (F_UNLCK) a byte-range lock on the image.
+** Locks are held on the directory slot, the allocation groups and the superblock
+** that an operation touches, so that several tools can work on one image at once.
+** Nobody waits for the superblock while holding group locks.
+** The stream is flushed around the lock so nothing buffered outside of it is
+** written late or read stale.
+*/
+static inline int qfs_lock(FILE *fp, long offset, long length, short type, int wait) {
+    if (type == F_UNLCK) fflush(fp);
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = length;
+    int rc;
+    do {
+        rc = fcntl(fileno(fp), wait ? F_SETLKW : F_SETLK, &fl);
+    } while (rc != 0 && errno == EINTR);
+    if (rc != 0) return -1;
+    if (type != F_UNLCK) fflush(fp);
+    return 0;
+}
+
+// Locks the whole byte range of an allocation group, including its descriptor
+static inline int qfs_lock_group(FILE *fp, const superblock_t *sb, uint32_t group,
+                                 short type, int wait) {
+    uint32_t size = qfs_group_size(sb);
+    uint32_t first = group * size;
+    uint32_t count = (sb->total_blocks - first < size) ? sb->total_blocks - first : size;
+    return qfs_lock(fp, qfs_data_start(sb) + (long)first * sb->bytes_per_block,
+                    (long)count * sb->bytes_per_block, type, wait);
+}
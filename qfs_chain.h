@@ -0,0 +1,107 @@
+/*
+**
+** Reading a file's data out of a QFS (Quinnipiac File System) image
+**
+** Usage: #include "qfs.h"
+**        #include "qfs_kernels.h"
+**        #include "qfs_chain.h"
+**
+**   qfs_chain_t chain = { fp, NULL, NULL, &sb, kernels, run };
+**   qfs_chain_begin(&chain, &entry, tail_tag);
+**   while ((length = qfs_chain_read(&chain, data)) > 0) ...
+**
+** The chain is read ahead QFS_RUN_BLOCKS blocks at a time, and as many of them
+** as it follows in order are copied out at once, so a contiguous file costs one
+** read per run. A packed file's tail fragment is returned last. `run` holds
+** QFS_RUN_BLOCKS whole blocks and `data` QFS_RUN_BLOCKS data areas.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Blocks read ahead at once while following a chain
+#define QFS_RUN_BLOCKS 32
+
+// Reads `count` whole blocks at `offset` into `dst`, returning how many were read
+typedef uint32_t (*qfs_chain_reader_t)(void *ctx, long offset, uint8_t *dst,
+                                       uint16_t bytes_per_block, uint32_t count);
+
+typedef struct qfs_chain {
+    FILE                *fp;       // Image, read with stdio unless `read` is set
+    qfs_chain_reader_t   read;     // Optional block reader, e.g. through O_DIRECT
+    void                *ctx;      // Passed to `read`
+    const superblock_t  *sb;
+    const qfs_kernels_t *kernels;
+    uint8_t             *run;      // QFS_RUN_BLOCKS whole blocks
+    uint16_t             start;    // First block of the file
+    uint16_t             address;  // Next chain block to read
+    uint16_t             tail_tag; // Owner of the file's tail fragment
+    int                  tail_done; // The tail fragment has been returned
+    uint32_t             chain_bytes; // Bytes held by the chain blocks
+    uint32_t             tail_bytes;  // Bytes held by the tail fragment
+    uint32_t             done;     // Chain bytes read so far
+} qfs_chain_t;
+
+// Starts reading the file of `entry`; `tail_tag` owns its fragment if it is packed
+static inline void qfs_chain_begin(qfs_chain_t *c, const direntry_t *entry, uint16_t tail_tag) {
+    uint32_t data_size = c->sb->bytes_per_block - 3;
+    c->tail_bytes = (entry->permissions & QFS_PERM_TAIL) ? entry->file_size % data_size : 0;
+    c->chain_bytes = entry->file_size - c->tail_bytes;
+    c->start = c->address = entry->starting_block;
+    c->tail_tag = tail_tag;
+    c->tail_done = 0;
+    c->done = 0;
+}
+
+// Reads `count` whole blocks of the image into `run`
+static inline uint32_t qfs_chain_load(qfs_chain_t *c, uint16_t block, uint32_t count) {
+    long offset = qfs_data_start(c->sb) + ((long)block * c->sb->bytes_per_block);
+    if (c->read) return c->read(c->ctx, offset, c->run, c->sb->bytes_per_block, count);
+    fseek(c->fp, offset, SEEK_SET);
+    return fread(c->run, c->sb->bytes_per_block, count, c->fp);
+}
+
+/*
+** Copies the next run of the file into `data`. Returns the number of bytes
+** copied, 0 once the whole file has been read, or -1 if the chain leaves the
+** image, a read fails or the tail fragment is missing.
+*/
+static inline long qfs_chain_read(qfs_chain_t *c, uint8_t *data) {
+    uint16_t bpb = c->sb->bytes_per_block;
+    uint32_t data_size = bpb - 3;
+    if (c->done < c->chain_bytes) {
+        if (c->address >= c->sb->total_blocks) return -1;
+        uint32_t want = (c->chain_bytes - c->done + data_size - 1) / data_size;
+        if (want > QFS_RUN_BLOCKS) want = QFS_RUN_BLOCKS;
+        if (want > (uint32_t)c->sb->total_blocks - c->address) want = c->sb->total_blocks - c->address;
+        uint32_t got = qfs_chain_load(c, c->address, want);
+        if (got == 0) return -1;
+
+        // Take as many blocks as the chain follows in order
+        uint32_t count = 0;
+        uint16_t next;
+        do {
+            memcpy(&next, c->run + ((count + 1) * bpb) - 2, sizeof(next));
+            count++;
+        } while (count < got && next == c->address + count);
+
+        c->kernels->copy_data(data, c->run, count, bpb);
+        uint32_t bytes = count * data_size;
+        if (bytes > c->chain_bytes - c->done) bytes = c->chain_bytes - c->done;
+        c->done += bytes;
+        c->address = next;
+        return bytes;
+    }
+    if (c->tail_bytes == 0 || c->tail_done) return 0;
+
+    // The last chain block points at the tail block, a tail-only file starts there
+    uint16_t tail_block = c->chain_bytes > 0 ? c->address : c->start;
+    if (tail_block >= c->sb->total_blocks || qfs_chain_load(c, tail_block, 1) != 1) return -1;
+    long offset = qfs_tail_find(c->run + 1, data_size, c->tail_tag);
+    if (offset < 0) return -1;
+    memcpy(data, c->run + 1 + offset + sizeof(tailfrag_t), c->tail_bytes);
+    c->tail_done = 1;
+    return c->tail_bytes;
+}
@@ -0,0 +1,669 @@
+/*
+ * qfs_copy.c
+ * Program that copies files straight from one or more QFS images into another,
+ * without staging them on the host
+ * CSC520 - Operating Systems
+ * Group: Aleena Graveline, Jean LaFrance, Horacio Valdes, Matthew Glennon
+ *
+ * Usage: qfs_copy [-t] [-n <file>]... <target image> <source image>...
+ *
+ *   -t         Pack each file's final partial block into a shared tail block
+ *   -n <file>  Copy only the named file (may be repeated). Without -n every file
+ *              of every source is copied, merging the sources into the target
+ *
+ * Source chains are read a run of consecutive blocks at a time, so the images
+ * may have different block sizes. The target is locked once for the whole copy:
+ * its directory lock first, then every allocation group. Each file is allocated
+ * one contiguous free extent when one is large enough, and its data is written a
+ * run at a time. Hashed directory entries are reserved before any block is
+ * planned, and a file whose source can't be read is dropped before it is
+ * written. The group descriptors, directory and superblock are committed once,
+ * at the end.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_kernels.h"
+#include "qfs_chain.h"
+
+// Blocks read or written at once
+#define RUN_BLOCKS QFS_RUN_BLOCKS
+
+// Blocks read at once when scanning the target's busy bytes
+#define SCAN_CHUNK 256
+
+// An open image
+typedef struct image {
+    const char          *name;
+    FILE                *fp;
+    superblock_t         sb;
+    long                 data_start;
+    const qfs_kernels_t *kernels;
+} image_t;
+
+// A file to copy and where it goes in the target
+typedef struct copyjob {
+    image_t    *source;
+    direntry_t  entry;             // Entry in the source image
+    uint16_t    source_tag;        // Owner tag of its tail fragment in the source
+    int         skip;              // Not copied (name already taken)
+    long        slot;              // Target directory slot, or -1 for the hashed directory
+    uint16_t    tag;               // Owner tag of its tail fragment in the target
+    uint32_t    chain_length;      // Whole blocks in the target
+    uint32_t    first_chain;       // Index of its first block in the planned block list
+    uint32_t    tail_length;       // Bytes packed into a target tail block (0 = none)
+    uint32_t    tail_index;        // Which new tail block holds them
+    size_t      tail_offset;       // Fragment header offset in that block's data area
+} copyjob_t;
+
+// Opens an image and checks its superblock. Returns 0 or an exit code.
+static int open_image(image_t *img, const char *name, const char *mode) {
+    img->name = name;
+    img->fp = fopen(name, mode);
+    if (!img->fp) {
+        perror(name);
+        return 2;
+    }
+    if (fread(&img->sb, sizeof(superblock_t), 1, img->fp) != 1 || img->sb.fs_type != 0x51 ||
+        img->sb.bytes_per_block < 3 + sizeof(tailfrag_t)) {
+        fprintf(stderr, "%s: invalid file system\n", name);
+        fclose(img->fp);
+        return 3;
+    }
+    img->data_start = qfs_data_start(&img->sb);
+    img->kernels = qfs_select_kernels(img->sb.bytes_per_block);
+    return 0;
+}
+
+static int wanted(const direntry_t *entry, char **names, int name_count, uint8_t *matched) {
+    if (name_count == 0) return 1;
+    for (int i = 0; i < name_count; i++) {
+        if (qfs_dir_names_match(entry, names[i])) {
+            matched[i] = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static copyjob_t *add_job(copyjob_t **jobs, size_t *count, size_t *capacity) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        copyjob_t *more = realloc(*jobs, grown * sizeof(copyjob_t));
+        if (!more) return NULL;
+        *jobs = more;
+        *capacity = grown;
+    }
+    copyjob_t *job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(*job));
+    return job;
+}
+
+// Adds the files of a source image, the table first and then the hashed directory
+static int collect_files(image_t *src, char **names, int name_count, uint8_t *matched,
+                         copyjob_t **jobs, size_t *count, size_t *capacity) {
+    direntry_t entry;
+    fseek(src->fp, sizeof(superblock_t), SEEK_SET);
+    for (int i = 0; i < src->sb.total_direntries; i++) {
+        if (fread(&entry, sizeof(direntry_t), 1, src->fp) != 1) return -1;
+        if (entry.filename[0] == '\0' || (entry.permissions & QFS_PERM_PENDING) ||
+            !wanted(&entry, names, name_count, matched)) continue;
+        copyjob_t *job = add_job(jobs, count, capacity);
+        if (!job) return -1;
+        job->source = src;
+        job->entry = entry;
+        job->source_tag = (uint16_t)i;
+    }
+    if (!(src->sb.flags & QFS_SB_HASHED_DIR)) return 0;
+
+    qfs_dir_t dir;
+    int rc = qfs_dir_open(&dir, src->fp, &src->sb);
+    if (rc == 0) rc = qfs_dir_lock(&dir, F_RDLCK);
+    qfs_dir_iter_t iter = {0, 0};
+    while (rc == 0 && (rc = qfs_dir_next(&dir, &iter, &entry)) > 0) {
+        rc = 0;
+        if ((entry.permissions & QFS_PERM_PENDING) || !wanted(&entry, names, name_count, matched)) {
+            continue;
+        }
+        copyjob_t *job = add_job(jobs, count, capacity);
+        if (!job) {
+            rc = -1;
+            break;
+        }
+        job->source = src;
+        job->entry = entry;
+        job->source_tag = qfs_name_tag(entry.filename);
+    }
+    qfs_dir_unlock(&dir);
+    qfs_dir_close(&dir);
+    return rc;
+}
+
+// Orders jobs by name, and jobs with the same name in the order they were found
+static int compare_jobs(const void *a, const void *b) {
+    const copyjob_t *x = *(copyjob_t *const *)a, *y = *(copyjob_t *const *)b;
+    int rc = strncmp(x->entry.filename, y->entry.filename, sizeof(x->entry.filename));
+    return rc ? rc : (x > y) - (x < y);
+}
+
+/*
+** Reads a file's data out of its source image into `dst`. Consecutive blocks of
+** the chain are read RUN_BLOCKS at a time; `run` and `data` hold one run.
+*/
+static int read_source(const copyjob_t *job, uint8_t *dst, uint8_t *run, uint8_t *data) {
+    const image_t *src = job->source;
+    qfs_chain_t chain = { src->fp, NULL, NULL, &src->sb, src->kernels, run };
+    qfs_chain_begin(&chain, &job->entry, job->source_tag);
+    size_t done = 0;
+    long bytes;
+    while ((bytes = qfs_chain_read(&chain, data)) > 0) {
+        memcpy(dst + done, data, bytes);
+        done += bytes;
+    }
+    return bytes < 0 ? -1 : 0;
+}
+
+/*
+** Takes `count` free blocks from the in-memory busy map, starting the search at
+** `*cursor`. The first free extent long enough is used whole; if there is none,
+** the first free blocks found are used. Returns -1 if there aren't enough.
+*/
+static int allocate_blocks(uint8_t *busy, uint32_t total, uint32_t count, uint8_t flag,
+                           uint16_t *blocks, uint32_t *cursor) {
+    if (count == 0) return 0;
+    uint32_t run = 0;
+    for (uint32_t k = 0; k < total && count > 0; k++) {
+        uint32_t i = (*cursor + k) % total;
+        if (i == 0) run = 0;
+        run = busy[i] == QFS_BLOCK_FREE ? run + 1 : 0;
+        if (run == count) {
+            uint32_t first = i + 1 - count;
+            for (uint32_t j = 0; j < count; j++) {
+                busy[first + j] = flag;
+                blocks[j] = (uint16_t)(first + j);
+            }
+            *cursor = (i + 1) % total;
+            return 0;
+        }
+    }
+
+    uint32_t found = 0;
+    for (uint32_t k = 0; k < total && found < count; k++) {
+        uint32_t i = (*cursor + k) % total;
+        if (busy[i] == QFS_BLOCK_FREE) blocks[found++] = (uint16_t)i;
+    }
+    if (found < count) return -1;
+    for (uint32_t j = 0; j < count; j++) busy[blocks[j]] = flag;
+    *cursor = (blocks[count - 1] + 1u) % total;
+    return 0;
+}
+
+// Takes back the pending hashed entries of files that won't be copied
+static void unreserve(qfs_dir_t *dir, copyjob_t *jobs, size_t job_count) {
+    for (size_t j = 0; j < job_count; j++) {
+        if (!jobs[j].skip && jobs[j].slot < 0) qfs_dir_remove(dir, jobs[j].entry.filename);
+    }
+}
+
+/*
+** Gives back what was planned for a file that won't be copied after all. Its
+** chain blocks are freed in the busy map and, once `written`, on disk. Its
+** fragment is cut out of its tail block, and the later fragments there move
+** down. A tail block left empty is freed too. Returns the blocks given back.
+*/
+static uint32_t drop_job(image_t *dst, copyjob_t *jobs, size_t job_count, copyjob_t *job,
+                         uint8_t *busy, const uint16_t *planned, const uint16_t *tail_blocks,
+                         uint8_t *tail_data, uint32_t *taken, int written) {
+    uint16_t bpb = dst->sb.bytes_per_block;
+    uint32_t data_size = bpb - 3;
+    uint32_t group_size = qfs_group_size(&dst->sb);
+    uint32_t released = 0;
+    for (uint32_t b = 0; b < job->chain_length; b++) {
+        uint16_t block = planned[job->first_chain + b];
+        busy[block] = QFS_BLOCK_FREE;
+        taken[block / group_size]--;
+        released++;
+        if (written) {
+            uint8_t free_flag = QFS_BLOCK_FREE;
+            fseek(dst->fp, dst->data_start + ((long)block * bpb), SEEK_SET);
+            fwrite(&free_flag, 1, 1, dst->fp);
+        }
+    }
+
+    if (job->tail_length) {
+        uint8_t *tail = tail_data + (size_t)job->tail_index * data_size;
+        size_t cut = sizeof(tailfrag_t) + job->tail_length;
+        size_t used = qfs_tail_remove(tail, data_size, job->tail_offset);
+        for (size_t k = 0; k < job_count; k++) {
+            copyjob_t *other = &jobs[k];
+            if (!other->skip && other->tail_length && other->tail_index == job->tail_index &&
+                other->tail_offset > job->tail_offset) {
+                other->tail_offset -= cut;
+            }
+        }
+        if (used == 0) {
+            uint16_t block = tail_blocks[job->tail_index];
+            busy[block] = QFS_BLOCK_FREE;
+            taken[block / group_size]--;
+            released++;
+        }
+    }
+    job->skip = 1;
+    return released;
+}
+
+// Writes chain blocks of the target, one fwrite per run of consecutive blocks
+static void write_chain(image_t *dst, const uint16_t *blocks, uint32_t length, uint16_t last_next,
+                        const uint8_t *data, uint32_t data_length, uint8_t *run) {
+    uint16_t bpb = dst->sb.bytes_per_block;
+    uint32_t data_size = bpb - 3;
+    uint32_t idx = 0;
+    while (idx < length) {
+        uint32_t count = 0;
+        do {
+            uint8_t *block = run + (size_t)count * bpb;
+            memset(block, 0, bpb);
+            block[0] = QFS_BLOCK_BUSY;
+            uint32_t offset = (idx + count) * data_size;
+            if (offset < data_length) {
+                uint32_t n = data_length - offset < data_size ? data_length - offset : data_size;
+                memcpy(block + 1, data + offset, n);
+            }
+            uint16_t next = (idx + count + 1 < length) ? blocks[idx + count + 1] : last_next;
+            memcpy(block + bpb - 2, &next, sizeof(uint16_t));
+            count++;
+        } while (idx + count < length && count < RUN_BLOCKS &&
+                 blocks[idx + count] == blocks[idx + count - 1] + 1);
+        fseek(dst->fp, dst->data_start + ((long)blocks[idx] * bpb), SEEK_SET);
+        fwrite(run, bpb, count, dst->fp);
+        idx += count;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int tail_mode = 0, arg = 1;
+    char **names = calloc(argc, sizeof(char *));
+    int name_count = 0;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-t") == 0) tail_mode = 1;
+        else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) names[name_count++] = argv[++arg];
+        else break;
+    }
+    if (argc - arg < 2 || argv[arg][0] == '-') {
+        fprintf(stderr, "Usage: %s [-t] [-n <file>]... <target image> <source image>...\n", argv[0]);
+        return 1;
+    }
+
+    image_t target;
+    int rc = open_image(&target, argv[arg], "rb+");
+    if (rc != 0) return rc;
+    struct stat target_stat;
+    fstat(fileno(target.fp), &target_stat);
+
+    // Gather the files to copy from every source
+    int source_count = argc - arg - 1;
+    image_t *sources = calloc(source_count, sizeof(image_t));
+    uint8_t *matched = calloc(name_count + 1, 1);
+    copyjob_t *jobs = NULL;
+    size_t job_count = 0, job_capacity = 0;
+    uint16_t max_bpb = target.sb.bytes_per_block;
+    if (!sources || !matched) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 5;
+    }
+    for (int s = 0; s < source_count; s++) {
+        rc = open_image(&sources[s], argv[arg + 1 + s], "rb");
+        if (rc != 0) return rc;
+        struct stat source_stat;
+        fstat(fileno(sources[s].fp), &source_stat);
+        if (source_stat.st_dev == target_stat.st_dev && source_stat.st_ino == target_stat.st_ino) {
+            fprintf(stderr, "%s: source and target are the same image\n", sources[s].name);
+            return 4;
+        }
+        if (sources[s].sb.bytes_per_block > max_bpb) max_bpb = sources[s].sb.bytes_per_block;
+        if (collect_files(&sources[s], names, name_count, matched, &jobs, &job_count,
+                          &job_capacity) != 0) {
+            fprintf(stderr, "%s: failed to read directory\n", sources[s].name);
+            return 7;
+        }
+    }
+    int status = 0;
+    for (int i = 0; i < name_count; i++) {
+        if (!matched[i]) {
+            fprintf(stderr, "%s: not found in any source\n", names[i]);
+            status = 9;
+        }
+    }
+
+    // A name found in more than one source is copied from the first
+    copyjob_t **sorted = malloc((job_count + 1) * sizeof(copyjob_t *));
+    if (!sorted) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 5;
+    }
+    for (size_t j = 0; j < job_count; j++) sorted[j] = &jobs[j];
+    qsort(sorted, job_count, sizeof(copyjob_t *), compare_jobs);
+    for (size_t j = 1; j < job_count; j++) {
+        if (strncmp(sorted[j - 1]->entry.filename, sorted[j]->entry.filename,
+                    sizeof(sorted[j]->entry.filename)) != 0) {
+            continue;
+        }
+        fprintf(stderr, "%s: skipped duplicate from %s\n", sorted[j]->entry.filename,
+                sorted[j]->source->name);
+        sorted[j]->skip = 1;
+        status = 9;
+    }
+    free(sorted);
+
+    /*
+    ** Lock the target: the directory first, then every allocation group in
+    ** ascending order. Holding the directory lock also keeps every other tool's
+    ** superblock commit out until the copy is done.
+    */
+    qfs_dir_t dir;
+    if (qfs_dir_open(&dir, target.fp, &target.sb) != 0 || qfs_dir_lock(&dir, F_WRLCK) != 0) {
+        fprintf(stderr, "%s: failed to lock directory\n", target.name);
+        return 8;
+    }
+
+    // Names the target already has are left alone
+    direntry_t *table = calloc(target.sb.total_direntries + 1, sizeof(direntry_t));
+    if (!table) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 5;
+    }
+    fseek(target.fp, sizeof(superblock_t), SEEK_SET);
+    if (fread(table, sizeof(direntry_t), target.sb.total_direntries, target.fp) !=
+        target.sb.total_direntries) {
+        fprintf(stderr, "%s: failed to read directory\n", target.name);
+        return 8;
+    }
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        int exists = job->skip ? 0 : qfs_dir_lookup(&dir, job->entry.filename, NULL);
+        for (int i = 0; i < target.sb.total_direntries && !job->skip && !exists; i++) {
+            exists = qfs_dir_names_match(&table[i], job->entry.filename);
+        }
+        if (exists) {
+            fprintf(stderr, "%s: already exists in %s\n", job->entry.filename, target.name);
+            job->skip = 1;
+            status = 9;
+        }
+    }
+
+    // Claim free table slots without waiting, since writers holding a slot may be
+    // waiting for a group. Files that get none go to the hashed directory.
+    int slot = 0, slots_used = 0;
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        job->slot = -1;
+        if (job->skip) continue;
+        for (; slot < target.sb.total_direntries && job->slot == -1; slot++) {
+            long offset = sizeof(superblock_t) + ((long)slot * sizeof(direntry_t));
+            if (table[slot].filename[0] != '\0' ||
+                qfs_lock(target.fp, offset, sizeof(direntry_t), F_WRLCK, 0) != 0) {
+                continue;
+            }
+            direntry_t current;
+            fseek(target.fp, offset, SEEK_SET);
+            if (fread(&current, sizeof(direntry_t), 1, target.fp) == 1 && current.filename[0] == '\0') {
+                job->slot = slot;
+                slots_used++;
+            } else {
+                qfs_lock(target.fp, offset, sizeof(direntry_t), F_UNLCK, 0);
+            }
+        }
+        job->tag = job->slot >= 0 ? (uint16_t)job->slot : qfs_name_tag(job->entry.filename);
+    }
+
+    // Files without a slot are reserved in the hashed directory, marked pending,
+    // so running out of entries is found before any block is planned for them
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        if (job->skip || job->slot >= 0) continue;
+        direntry_t pending = job->entry;
+        pending.permissions = QFS_PERM_PENDING;
+        pending.starting_block = 0xFFFF;
+        if (qfs_dir_insert(&dir, &pending) != 0) {
+            fprintf(stderr, "%s: no free directory entry for %s\n", target.name, job->entry.filename);
+            job->skip = 1;
+            status = 8;
+        }
+    }
+
+    uint32_t group_count = qfs_group_count(&target.sb);
+    uint32_t group_size = qfs_group_size(&target.sb);
+    for (uint32_t g = 0; g < group_count; g++) {
+        qfs_lock_group(target.fp, &target.sb, g, F_WRLCK, 1);
+    }
+    // Directory blocks are written under the group locks already held
+    dir.groups_held = 1;
+
+    // Read the busy byte of every target block once
+    uint32_t total = target.sb.total_blocks;
+    uint16_t bpb = target.sb.bytes_per_block;
+    uint32_t data_size = bpb - 3;
+    uint8_t *busy = malloc(total + 1);
+    uint8_t *run = malloc((size_t)(RUN_BLOCKS > SCAN_CHUNK ? RUN_BLOCKS : SCAN_CHUNK) * max_bpb);
+    uint8_t *data = malloc((size_t)RUN_BLOCKS * max_bpb);
+    if (!busy || !run || !data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        unreserve(&dir, jobs, job_count);
+        return 5;
+    }
+    for (uint32_t i = 0; i < total; i += SCAN_CHUNK) {
+        uint32_t count = total - i < SCAN_CHUNK ? total - i : SCAN_CHUNK;
+        fseek(target.fp, target.data_start + ((long)i * bpb), SEEK_SET);
+        size_t got = fread(run, bpb, count, target.fp);
+        target.kernels->scan_busy(busy + i, run, got, bpb);
+        memset(busy + i + got, QFS_BLOCK_BUSY, count - got);
+    }
+
+    /*
+    ** Plan every file before writing anything: its chain blocks, and with -t the
+    ** tail block and offset of its final partial block. New tail blocks are
+    ** filled in order and never hold two fragments with the same tag.
+    */
+    size_t planned_capacity = 64, planned_count = 0;
+    uint16_t *planned = malloc(planned_capacity * sizeof(uint16_t));
+    uint16_t *tail_blocks = NULL;
+    uint8_t *tail_data = NULL;
+    uint32_t tail_count = 0, cursor = 0;
+    uint32_t *taken = calloc(group_count, sizeof(uint32_t));
+    if (!planned || !taken) {
+        fprintf(stderr, "Memory allocation failed\n");
+        unreserve(&dir, jobs, job_count);
+        return 5;
+    }
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        if (job->skip) continue;
+        uint32_t size = job->entry.file_size;
+        job->tail_length = tail_mode ? qfs_tail_length(size, data_size) : 0;
+        job->chain_length = qfs_chain_blocks(size, data_size, job->tail_length != 0);
+
+        while (planned_count + job->chain_length > planned_capacity) planned_capacity *= 2;
+        uint16_t *grown = realloc(planned, planned_capacity * sizeof(uint16_t));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed\n");
+            unreserve(&dir, jobs, job_count);
+            return 5;
+        }
+        planned = grown;
+        job->first_chain = planned_count;
+        if (allocate_blocks(busy, total, job->chain_length, QFS_BLOCK_BUSY,
+                            planned + planned_count, &cursor) != 0) {
+            fprintf(stderr, "%s: not enough free blocks for %s\n", target.name, job->entry.filename);
+            unreserve(&dir, jobs, job_count);
+            return 6;
+        }
+        for (uint32_t b = 0; b < job->chain_length; b++) taken[planned[planned_count + b] / group_size]++;
+        planned_count += job->chain_length;
+        if (job->tail_length == 0) continue;
+
+        uint8_t *current = tail_count ? tail_data + (size_t)(tail_count - 1) * data_size : NULL;
+        size_t used = current ? qfs_tail_used(current, data_size) : 0;
+        if (!current || used + sizeof(tailfrag_t) + job->tail_length > data_size ||
+            qfs_tail_find(current, data_size, job->tag) >= 0) {
+            uint16_t *more_blocks = realloc(tail_blocks, (tail_count + 1) * sizeof(uint16_t));
+            uint8_t *more_data = realloc(tail_data, (size_t)(tail_count + 1) * data_size);
+            if (more_blocks) tail_blocks = more_blocks;
+            if (more_data) tail_data = more_data;
+            if (!more_blocks || !more_data) {
+                fprintf(stderr, "Memory allocation failed\n");
+                unreserve(&dir, jobs, job_count);
+                return 5;
+            }
+            if (allocate_blocks(busy, total, 1, QFS_BLOCK_TAIL, &tail_blocks[tail_count], &cursor) != 0) {
+                fprintf(stderr, "%s: not enough free blocks for %s\n", target.name,
+                        job->entry.filename);
+                unreserve(&dir, jobs, job_count);
+                return 6;
+            }
+            taken[tail_blocks[tail_count] / group_size]++;
+            current = tail_data + (size_t)tail_count * data_size;
+            memset(current, 0, data_size);
+            tail_count++;
+            used = 0;
+        }
+        tailfrag_t frag = { job->tag, (uint16_t)job->tail_length };
+        memcpy(current + used, &frag, sizeof(tailfrag_t));
+        job->tail_index = tail_count - 1;
+        job->tail_offset = used;
+    }
+
+    /*
+    ** Copy each file, reading its source chain and writing its target chain in
+    ** runs. A file whose source can't be read is dropped before anything of it
+    ** is written, and its reservation is taken back.
+    */
+    size_t file_capacity = 1;
+    for (size_t j = 0; j < job_count; j++) {
+        if (!jobs[j].skip && jobs[j].entry.file_size > file_capacity) file_capacity = jobs[j].entry.file_size;
+    }
+    uint8_t *file_data = malloc(file_capacity);
+    if (!file_data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        unreserve(&dir, jobs, job_count);
+        return 5;
+    }
+    size_t copied = 0;
+    uint32_t released = 0;
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        if (job->skip) continue;
+        size_t size = job->entry.file_size;
+        if (read_source(job, file_data, run, data) != 0) {
+            fprintf(stderr, "%s: failed to read %s, skipped\n", job->source->name,
+                    job->entry.filename);
+            released += drop_job(&target, jobs, job_count, job, busy, planned, tail_blocks,
+                                 tail_data, taken, 0);
+            if (job->slot >= 0) slots_used--;
+            else qfs_dir_remove(&dir, job->entry.filename);
+            status = 7;
+            continue;
+        }
+
+        uint32_t chain_bytes = (uint32_t)size - job->tail_length;
+        uint16_t last_next = job->tail_length ? tail_blocks[job->tail_index] : 0xFFFF;
+        write_chain(&target, planned + job->first_chain, job->chain_length, last_next,
+                    file_data, chain_bytes, run);
+        if (job->tail_length) {
+            memcpy(tail_data + (size_t)job->tail_index * data_size + job->tail_offset +
+                   sizeof(tailfrag_t), file_data + chain_bytes, job->tail_length);
+        }
+
+        job->entry.permissions &= ~(QFS_PERM_TAIL | QFS_PERM_PENDING);
+        if (job->tail_length) job->entry.permissions |= QFS_PERM_TAIL;
+        job->entry.starting_block = job->chain_length ? planned[job->first_chain] :
+                                                        tail_blocks[job->tail_index];
+        copied++;
+    }
+    free(file_data);
+
+    /*
+    ** Fill in the hashed entries before the tail blocks are written. Nobody sees
+    ** them until the directory lock is released, and a file whose entry can't
+    ** be written is dropped, its chain blocks freed again on disk.
+    */
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        if (job->skip || job->slot >= 0) continue;
+        if (qfs_dir_update(&dir, &job->entry) != 0) {
+            fprintf(stderr, "%s: failed to write directory entry for %s\n", target.name,
+                    job->entry.filename);
+            released += drop_job(&target, jobs, job_count, job, busy, planned, tail_blocks,
+                                 tail_data, taken, 1);
+            qfs_dir_remove(&dir, job->entry.filename);
+            copied--;
+            status = 8;
+        }
+    }
+
+    for (uint32_t t = 0; t < tail_count; t++) {
+        // Tail blocks emptied by dropped files stay free
+        if (busy[tail_blocks[t]] != QFS_BLOCK_TAIL) continue;
+        uint8_t *block = run;
+        block[0] = QFS_BLOCK_TAIL;
+        memcpy(block + 1, tail_data + (size_t)t * data_size, data_size);
+        uint16_t next = 0xFFFF;
+        memcpy(block + bpb - 2, &next, sizeof(uint16_t));
+        fseek(target.fp, target.data_start + ((long)tail_blocks[t] * bpb), SEEK_SET);
+        fwrite(block, bpb, 1, target.fp);
+    }
+
+    // Take the used blocks off their groups' free counts
+    for (uint32_t g = 0; g < group_count && target.sb.blocks_per_group; g++) {
+        if (taken[g] == 0) continue;
+        groupdesc_t desc;
+        long desc_offset = target.data_start + ((long)g * group_size * bpb) + 1;
+        fseek(target.fp, desc_offset, SEEK_SET);
+        if (fread(&desc, sizeof(groupdesc_t), 1, target.fp) == 1) {
+            desc.free_blocks -= taken[g];
+            fseek(target.fp, desc_offset, SEEK_SET);
+            fwrite(&desc, sizeof(groupdesc_t), 1, target.fp);
+        }
+    }
+    for (uint32_t g = 0; g < group_count; g++) {
+        qfs_lock_group(target.fp, &target.sb, g, F_UNLCK, 0);
+    }
+    dir.groups_held = 0;
+
+    // Commit the table entries, then the superblock
+    uint32_t used_blocks = planned_count + tail_count - released;
+    for (size_t j = 0; j < job_count; j++) {
+        copyjob_t *job = &jobs[j];
+        if (job->skip || job->slot < 0) continue;
+        fseek(target.fp, sizeof(superblock_t) + (job->slot * sizeof(direntry_t)), SEEK_SET);
+        fwrite(&job->entry, sizeof(direntry_t), 1, target.fp);
+    }
+    target.sb.available_blocks -= used_blocks;
+    target.sb.available_direntries -= slots_used;
+    fseek(target.fp, 0, SEEK_SET);
+    fwrite(&target.sb, sizeof(superblock_t), 1, target.fp);
+
+    printf("Copied %zu files (%u blocks) into %s\n", copied, used_blocks, target.name);
+
+    // Closing the target flushes it and releases its locks
+    qfs_dir_close(&dir);
+    fclose(target.fp);
+    for (int s = 0; s < source_count; s++) fclose(sources[s].fp);
+    free(tail_blocks);
+    free(tail_data);
+    free(taken);
+    free(planned);
+    free(busy);
+    free(run);
+    free(data);
+    free(table);
+    free(jobs);
+    free(sources);
+    free(matched);
+    free(names);
+    return status;
+}
@@ -0,0 +1,515 @@
+/*
+**
+** Hashed directory for the QFS (Quinnipiac File System)
+**
+** Usage: #include "qfs.h"
+**        #include "qfs_dir.h"
+**
+** Once the 255-slot directory table is full, more entries go into an
+** extendible hash directory kept in data blocks (is_busy = QFS_BLOCK_DIR).
+** It is created on demand and recorded in the superblock.
+**
+**   Index      A chain of blocks starting at sb.dir_index. It holds a dirindex_t
+**              header, the block number of every index block, the block number
+**              of every bucket in creation order, and the directory array that
+**              maps the low global_depth bits of a name's hash to a bucket.
+**   Bucket     One block. Its data area starts with the bucket's local depth,
+**              followed by as many direntry_t slots as fit.
+**
+** A lookup, insert or delete reads the index header with its table of index
+** blocks, the directory and bucket array entries for the name, and then the one
+** bucket the name hashes to: a fixed number of reads however long the index is.
+** The whole index is only loaded to split a full bucket in two, or to iterate. The
+** directory array doubles when the bucket's depth is already the global depth.
+**
+** Entries move between buckets when one splits. So a packed tail of a hashed
+** entry is tagged with qfs_name_tag() rather than its position. Writers never
+** put two fragments with the same tag into one tail block.
+**
+** Changes are made holding qfs_dir_lock(). Every superblock commit locks the
+** whole superblock, and the lock covers part of it, so the lock holder also has
+** the superblock to itself. It may take group locks while holding it.
+** Nobody may wait for it while holding group locks.
+**
+** Directory blocks lie inside allocation groups, and O_DIRECT writers write back
+** whole pages of the groups they hold. So a directory block is written holding
+** its group's lock as well, unless the caller already holds every group.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define QFS_DIR_MAX_DEPTH   12
+#define QFS_DIR_MAX_BUCKETS (1 << QFS_DIR_MAX_DEPTH)
+#define QFS_DIR_MAX_CHAIN   40     // Index blocks; full arrays in 509-byte data areas take 33
+
+#pragma pack(push,1)
+
+// Hashed Directory Index Header (start of the first index block's data area)
+typedef struct dirindex {
+    uint8_t  global_depth;         // Hash bits used to pick a bucket
+    uint16_t bucket_count;         // Number of bucket blocks
+    uint32_t entry_count;          // Number of entries in all buckets
+} dirindex_t;
+
+#pragma pack(pop)
+
+// Offset of the bucket array in the serialized index, past the header and block table
+#define QFS_DIR_ARRAYS (sizeof(dirindex_t) + QFS_DIR_MAX_CHAIN * sizeof(uint16_t))
+
+// Hashed directory state, loaded from the image
+typedef struct qfs_dir {
+    FILE         *fp;
+    superblock_t *sb;
+    long          data_start;
+    size_t        data_size;       // Data area size of one block
+    size_t        slots;           // Entries per bucket
+    dirindex_t    header;
+    uint16_t     *buckets;         // Bucket ordinal -> block number
+    uint16_t     *directory;       // Low hash bits -> bucket ordinal
+    uint16_t     *chain;           // Index block numbers, in chain order
+    size_t        chain_length;
+    int           loaded;          // buckets, directory and chain are in memory
+    int           groups_held;     // The caller holds every group lock itself
+    uint8_t      *block;           // Scratch blocks
+    uint8_t      *spare;
+} qfs_dir_t;
+
+// Position of an entry, used to iterate in order
+typedef struct qfs_dir_iter {
+    uint32_t ordinal;
+    uint32_t slot;
+} qfs_dir_iter_t;
+
+// FNV-1a hash of a name as it is stored in a direntry
+static inline uint32_t qfs_name_hash(const char *name) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < sizeof(((direntry_t *)0)->filename) - 1 && name[i]; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+// Tail fragment tag of an entry in the hashed directory
+static inline uint16_t qfs_name_tag(const char *name) {
+    uint32_t hash = qfs_name_hash(name);
+    return (uint16_t)((hash >> 16) ^ hash);
+}
+
+static inline int qfs_dir_names_match(const direntry_t *entry, const char *name) {
+    return entry->filename[0] != '\0' &&
+           strncmp(entry->filename, name, sizeof(entry->filename) - 1) == 0;
+}
+
+static inline long qfs_dir_offset(const qfs_dir_t *d, uint16_t block) {
+    return d->data_start + ((long)block * d->sb->bytes_per_block);
+}
+
+static inline int qfs_dir_read_block(qfs_dir_t *d, uint16_t block, uint8_t *buffer) {
+    fseek(d->fp, qfs_dir_offset(d, block), SEEK_SET);
+    return fread(buffer, d->sb->bytes_per_block, 1, d->fp) == 1 ? 0 : -1;
+}
+
+// Takes or releases the lock of the group holding a directory block
+static inline int qfs_dir_lock_block(qfs_dir_t *d, uint16_t block, short type) {
+    if (d->groups_held) return 0;
+    return qfs_lock_group(d->fp, d->sb, block / qfs_group_size(d->sb), type, type != F_UNLCK);
+}
+
+static inline int qfs_dir_write_block(qfs_dir_t *d, uint16_t block, const uint8_t *buffer) {
+    if (qfs_dir_lock_block(d, block, F_WRLCK) != 0) return -1;
+    fseek(d->fp, qfs_dir_offset(d, block), SEEK_SET);
+    int rc = fwrite(buffer, d->sb->bytes_per_block, 1, d->fp) == 1 ? 0 : -1;
+    qfs_dir_lock_block(d, block, F_UNLCK);
+    return rc;
+}
+
+static inline direntry_t *qfs_dir_slot(const qfs_dir_t *d, uint8_t *bucket, size_t slot) {
+    (void)d;
+    return (direntry_t *)(bucket + 2 + slot * sizeof(direntry_t));
+}
+
+static inline int qfs_dir_open(qfs_dir_t *d, FILE *fp, superblock_t *sb) {
+    memset(d, 0, sizeof(*d));
+    d->fp = fp;
+    d->sb = sb;
+    d->data_start = qfs_data_start(sb);
+    d->data_size = sb->bytes_per_block - 3;
+    d->slots = (d->data_size - 1) / sizeof(direntry_t);
+    d->buckets = calloc(QFS_DIR_MAX_BUCKETS, sizeof(uint16_t));
+    d->directory = calloc(QFS_DIR_MAX_BUCKETS, sizeof(uint16_t));
+    d->chain = calloc(QFS_DIR_MAX_CHAIN, sizeof(uint16_t));
+    d->block = malloc(sb->bytes_per_block);
+    d->spare = malloc(sb->bytes_per_block);
+    if (!d->buckets || !d->directory || !d->chain || !d->block || !d->spare) return -1;
+    return 0;
+}
+
+static inline void qfs_dir_close(qfs_dir_t *d) {
+    free(d->buckets);
+    free(d->directory);
+    free(d->chain);
+    free(d->block);
+    free(d->spare);
+    memset(d, 0, sizeof(*d));
+}
+
+// Bytes the serialized index takes
+static inline size_t qfs_dir_index_size(const qfs_dir_t *d) {
+    return QFS_DIR_ARRAYS + (d->header.bucket_count * sizeof(uint16_t)) +
+           ((size_t)1 << d->header.global_depth) * sizeof(uint16_t);
+}
+
+// Reads `length` bytes at `offset` in the serialized index. The block table
+// names the block holding every part, so this is one read per block touched.
+static inline int qfs_dir_index_read(qfs_dir_t *d, size_t offset, void *out, size_t length) {
+    uint8_t *dst = out;
+    while (length > 0) {
+        size_t i = offset / d->data_size, within = offset % d->data_size;
+        if (i >= d->chain_length) return -1;
+        size_t n = length < d->data_size - within ? length : d->data_size - within;
+        fseek(d->fp, qfs_dir_offset(d, d->chain[i]) + 1 + (long)within, SEEK_SET);
+        if (fread(dst, 1, n, d->fp) != n) return -1;
+        dst += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads the index header and block table. An image without a hashed directory has an empty one.
+static inline int qfs_dir_load_header(qfs_dir_t *d) {
+    memset(&d->header, 0, sizeof(d->header));
+    d->chain_length = 0;
+    d->loaded = 0;
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return 0;
+
+    uint8_t head[QFS_DIR_ARRAYS];
+    fseek(d->fp, qfs_dir_offset(d, d->sb->dir_index) + 1, SEEK_SET);
+    if (fread(head, sizeof(head), 1, d->fp) != 1) return -1;
+    memcpy(&d->header, head, sizeof(dirindex_t));
+    for (size_t i = 0; i < QFS_DIR_MAX_CHAIN; i++) {
+        uint16_t block;
+        memcpy(&block, head + sizeof(dirindex_t) + i * sizeof(uint16_t), sizeof(uint16_t));
+        if (block == 0xFFFF) break;
+        if (block >= d->sb->total_blocks) return -1;
+        d->chain[d->chain_length++] = block;
+    }
+    if (d->header.global_depth > QFS_DIR_MAX_DEPTH || d->header.bucket_count > QFS_DIR_MAX_BUCKETS ||
+        d->chain_length * d->data_size < qfs_dir_index_size(d)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the whole index into memory. An image without a hashed directory has an empty one.
+static inline int qfs_dir_load(qfs_dir_t *d) {
+    if (qfs_dir_load_header(d) != 0) return -1;
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return 0;
+    size_t buckets_size = d->header.bucket_count * sizeof(uint16_t);
+    size_t directory_size = ((size_t)1 << d->header.global_depth) * sizeof(uint16_t);
+    if (qfs_dir_index_read(d, QFS_DIR_ARRAYS, d->buckets, buckets_size) != 0 ||
+        qfs_dir_index_read(d, QFS_DIR_ARRAYS + buckets_size, d->directory, directory_size) != 0) {
+        return -1;
+    }
+    d->loaded = 1;
+    return 0;
+}
+
+// Takes a free block from the first allocation group that has one and marks it
+// as a directory block. Returns the block number or -1 if the image is full.
+static inline long qfs_dir_alloc_block(qfs_dir_t *d) {
+    superblock_t *sb = d->sb;
+    uint32_t size = qfs_group_size(sb);
+    for (uint32_t g = 0; g < qfs_group_count(sb); g++) {
+        uint32_t first = g * size;
+        uint32_t end = (sb->total_blocks - first < size) ? sb->total_blocks : first + size;
+        if (qfs_lock_group(d->fp, sb, g, F_WRLCK, 1) != 0) return -1;
+
+        groupdesc_t desc = { 1 };
+        long desc_offset = qfs_dir_offset(d, first) + 1;
+        if (sb->blocks_per_group) {
+            fseek(d->fp, desc_offset, SEEK_SET);
+            if (fread(&desc, sizeof(groupdesc_t), 1, d->fp) != 1) desc.free_blocks = 0;
+            first++;
+        }
+        for (uint32_t i = first; i < end && desc.free_blocks > 0; i++) {
+            uint8_t busy_flag;
+            fseek(d->fp, qfs_dir_offset(d, i), SEEK_SET);
+            if (fread(&busy_flag, 1, 1, d->fp) != 1 || busy_flag != QFS_BLOCK_FREE) continue;
+
+            busy_flag = QFS_BLOCK_DIR;
+            fseek(d->fp, qfs_dir_offset(d, i), SEEK_SET);
+            fwrite(&busy_flag, 1, 1, d->fp);
+            if (sb->blocks_per_group) {
+                desc.free_blocks--;
+                fseek(d->fp, desc_offset, SEEK_SET);
+                fwrite(&desc, sizeof(groupdesc_t), 1, d->fp);
+            }
+            qfs_lock_group(d->fp, sb, g, F_UNLCK, 0);
+
+            // The directory lock holder has the superblock to itself
+            sb->available_blocks--;
+            fseek(d->fp, 0, SEEK_SET);
+            fwrite(sb, sizeof(superblock_t), 1, d->fp);
+            return i;
+        }
+        qfs_lock_group(d->fp, sb, g, F_UNLCK, 0);
+    }
+    return -1;
+}
+
+// Writes the index header into the first index block
+static inline int qfs_dir_save_header(qfs_dir_t *d) {
+    if (qfs_dir_lock_block(d, d->sb->dir_index, F_WRLCK) != 0) return -1;
+    fseek(d->fp, qfs_dir_offset(d, d->sb->dir_index) + 1, SEEK_SET);
+    int rc = fwrite(&d->header, sizeof(dirindex_t), 1, d->fp) == 1 ? 0 : -1;
+    qfs_dir_lock_block(d, d->sb->dir_index, F_UNLCK);
+    return rc;
+}
+
+// Writes the whole index, growing its chain if it no longer fits
+static inline int qfs_dir_save_index(qfs_dir_t *d) {
+    size_t size = qfs_dir_index_size(d);
+    size_t blocks = (size + d->data_size - 1) / d->data_size;
+    if (blocks > QFS_DIR_MAX_CHAIN) return -1;
+    while (d->chain_length < blocks) {
+        long block = qfs_dir_alloc_block(d);
+        if (block < 0) return -1;
+        d->chain[d->chain_length++] = (uint16_t)block;
+    }
+
+    uint8_t *index = calloc(blocks, d->data_size);
+    if (!index) return -1;
+    memcpy(index, &d->header, sizeof(dirindex_t));
+    memset(index + sizeof(dirindex_t), 0xFF, QFS_DIR_MAX_CHAIN * sizeof(uint16_t));
+    memcpy(index + sizeof(dirindex_t), d->chain, d->chain_length * sizeof(uint16_t));
+    memcpy(index + QFS_DIR_ARRAYS, d->buckets, d->header.bucket_count * sizeof(uint16_t));
+    memcpy(index + QFS_DIR_ARRAYS + d->header.bucket_count * sizeof(uint16_t), d->directory,
+           ((size_t)1 << d->header.global_depth) * sizeof(uint16_t));
+    for (size_t i = 0; i < d->chain_length; i++) {
+        memset(d->block, 0, d->sb->bytes_per_block);
+        d->block[0] = QFS_BLOCK_DIR;
+        if (i < blocks) memcpy(d->block + 1, index + i * d->data_size, d->data_size);
+        uint16_t next = (i + 1 < d->chain_length) ? d->chain[i + 1] : 0xFFFF;
+        memcpy(d->block + d->sb->bytes_per_block - 2, &next, sizeof(uint16_t));
+        if (qfs_dir_write_block(d, d->chain[i], d->block) != 0) {
+            free(index);
+            return -1;
+        }
+    }
+    free(index);
+    return 0;
+}
+
+// Writes an empty bucket with the given local depth to a directory block
+static inline int qfs_dir_init_bucket(qfs_dir_t *d, uint16_t block, uint8_t depth) {
+    memset(d->spare, 0, d->sb->bytes_per_block);
+    d->spare[0] = QFS_BLOCK_DIR;
+    d->spare[1] = depth;
+    uint16_t next = 0xFFFF;
+    memcpy(d->spare + d->sb->bytes_per_block - 2, &next, sizeof(uint16_t));
+    return qfs_dir_write_block(d, block, d->spare);
+}
+
+// Creates an empty hashed directory with one bucket and records it in the superblock
+static inline int qfs_dir_create(qfs_dir_t *d) {
+    long index_block = qfs_dir_alloc_block(d);
+    long bucket_block = index_block < 0 ? -1 : qfs_dir_alloc_block(d);
+    if (bucket_block < 0 || qfs_dir_init_bucket(d, (uint16_t)bucket_block, 0) != 0) return -1;
+
+    memset(&d->header, 0, sizeof(d->header));
+    d->header.bucket_count = 1;
+    d->buckets[0] = (uint16_t)bucket_block;
+    d->directory[0] = 0;
+    d->chain[0] = (uint16_t)index_block;
+    d->chain_length = 1;
+    d->loaded = 1;
+    if (qfs_dir_save_index(d) != 0) return -1;
+
+    d->sb->flags |= QFS_SB_HASHED_DIR;
+    d->sb->dir_index = (uint16_t)index_block;
+    fseek(d->fp, 0, SEEK_SET);
+    return fwrite(d->sb, sizeof(superblock_t), 1, d->fp) == 1 ? 0 : -1;
+}
+
+/*
+** Locks the hashed directory (F_WRLCK to change it, F_RDLCK to read it), then
+** re-reads the superblock and index header, which other tools may have changed.
+** The rest of the index is read as it is needed.
+*/
+static inline int qfs_dir_lock(qfs_dir_t *d, short type) {
+    if (qfs_lock(d->fp, offsetof(superblock_t, dir_index), sizeof(uint16_t), type, 1) != 0) {
+        return -1;
+    }
+    fseek(d->fp, 0, SEEK_SET);
+    if (fread(d->sb, sizeof(superblock_t), 1, d->fp) != 1) return -1;
+    return qfs_dir_load_header(d);
+}
+
+static inline void qfs_dir_unlock(qfs_dir_t *d) {
+    qfs_lock(d->fp, offsetof(superblock_t, dir_index), sizeof(uint16_t), F_UNLCK, 0);
+}
+
+/*
+** Reads the bucket `name` hashes to into d->block and returns its block number.
+** Without the whole index in memory only its two array entries are read.
+*/
+static inline long qfs_dir_bucket(qfs_dir_t *d, const char *name, uint16_t *ordinal) {
+    uint32_t slot = qfs_name_hash(name) & ((1u << d->header.global_depth) - 1);
+    uint16_t block;
+    if (d->loaded) {
+        *ordinal = d->directory[slot];
+        block = d->buckets[*ordinal];
+    } else {
+        size_t buckets_offset = QFS_DIR_ARRAYS;
+        size_t directory_offset = buckets_offset + d->header.bucket_count * sizeof(uint16_t);
+        if (qfs_dir_index_read(d, directory_offset + slot * sizeof(uint16_t), ordinal,
+                               sizeof(uint16_t)) != 0 ||
+            *ordinal >= d->header.bucket_count ||
+            qfs_dir_index_read(d, buckets_offset + *ordinal * sizeof(uint16_t), &block,
+                               sizeof(uint16_t)) != 0) {
+            return -1;
+        }
+    }
+    if (block >= d->sb->total_blocks) return -1;
+    return qfs_dir_read_block(d, block, d->block) == 0 ? block : -1;
+}
+
+// Finds `name` in the hashed directory. Returns 1 and copies the entry if found.
+static inline int qfs_dir_lookup(qfs_dir_t *d, const char *name, direntry_t *entry) {
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return 0;
+    uint16_t ordinal;
+    if (qfs_dir_bucket(d, name, &ordinal) < 0) return -1;
+    for (size_t s = 0; s < d->slots; s++) {
+        direntry_t *slot = qfs_dir_slot(d, d->block, s);
+        if (qfs_dir_names_match(slot, name)) {
+            if (entry) memcpy(entry, slot, sizeof(direntry_t));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Splits the full bucket in d->block (at `block`, bucket ordinal `ordinal`) in two
+static inline int qfs_dir_split(qfs_dir_t *d, uint16_t block, uint16_t ordinal) {
+    uint8_t depth = d->block[1];
+    if (depth >= QFS_DIR_MAX_DEPTH || d->header.bucket_count >= QFS_DIR_MAX_BUCKETS) return -1;
+
+    // Double the directory array when the bucket already uses every hash bit
+    if (depth == d->header.global_depth) {
+        size_t size = (size_t)1 << d->header.global_depth;
+        memcpy(d->directory + size, d->directory, size * sizeof(uint16_t));
+        d->header.global_depth++;
+    }
+
+    long new_block = qfs_dir_alloc_block(d);
+    if (new_block < 0 || qfs_dir_init_bucket(d, (uint16_t)new_block, depth + 1) != 0) return -1;
+    if (qfs_dir_read_block(d, block, d->block) != 0) return -1;
+
+    // Entries whose next hash bit is set move to the new bucket
+    size_t moved = 0;
+    for (size_t s = 0; s < d->slots; s++) {
+        direntry_t *slot = qfs_dir_slot(d, d->block, s);
+        if (slot->filename[0] == '\0' || !((qfs_name_hash(slot->filename) >> depth) & 1)) continue;
+        memcpy(qfs_dir_slot(d, d->spare, moved++), slot, sizeof(direntry_t));
+        memset(slot, 0, sizeof(direntry_t));
+    }
+    d->block[1] = depth + 1;
+    if (qfs_dir_write_block(d, (uint16_t)new_block, d->spare) != 0 ||
+        qfs_dir_write_block(d, block, d->block) != 0) {
+        return -1;
+    }
+
+    uint16_t new_ordinal = d->header.bucket_count++;
+    d->buckets[new_ordinal] = (uint16_t)new_block;
+    for (size_t i = 0; i < ((size_t)1 << d->header.global_depth); i++) {
+        if (d->directory[i] == ordinal && ((i >> depth) & 1)) d->directory[i] = new_ordinal;
+    }
+    return qfs_dir_save_index(d);
+}
+
+// Adds an entry, creating the hashed directory first if needed. Returns -1 if full.
+static inline int qfs_dir_insert(qfs_dir_t *d, const direntry_t *entry) {
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR) && qfs_dir_create(d) != 0) return -1;
+    for (;;) {
+        uint16_t ordinal;
+        long block = qfs_dir_bucket(d, entry->filename, &ordinal);
+        if (block < 0) return -1;
+        for (size_t s = 0; s < d->slots; s++) {
+            direntry_t *slot = qfs_dir_slot(d, d->block, s);
+            if (slot->filename[0] != '\0') continue;
+            memcpy(slot, entry, sizeof(direntry_t));
+            if (qfs_dir_write_block(d, (uint16_t)block, d->block) != 0) return -1;
+            d->header.entry_count++;
+            return qfs_dir_save_header(d);
+        }
+        // Splitting rewrites the index, so it has to be read in whole first
+        if (!d->loaded && (qfs_dir_load(d) != 0 ||
+                           qfs_dir_read_block(d, (uint16_t)block, d->block) != 0)) {
+            return -1;
+        }
+        if (qfs_dir_split(d, (uint16_t)block, ordinal) != 0) return -1;
+    }
+}
+
+// Overwrites the entry with the same name. Returns 0 if it was found.
+static inline int qfs_dir_update(qfs_dir_t *d, const direntry_t *entry) {
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return -1;
+    uint16_t ordinal;
+    long block = qfs_dir_bucket(d, entry->filename, &ordinal);
+    if (block < 0) return -1;
+    for (size_t s = 0; s < d->slots; s++) {
+        direntry_t *slot = qfs_dir_slot(d, d->block, s);
+        if (qfs_dir_names_match(slot, entry->filename)) {
+            memcpy(slot, entry, sizeof(direntry_t));
+            return qfs_dir_write_block(d, (uint16_t)block, d->block);
+        }
+    }
+    return -1;
+}
+
+// Removes `name`. Returns 0 if it was found.
+static inline int qfs_dir_remove(qfs_dir_t *d, const char *name) {
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return -1;
+    uint16_t ordinal;
+    long block = qfs_dir_bucket(d, name, &ordinal);
+    if (block < 0) return -1;
+    for (size_t s = 0; s < d->slots; s++) {
+        direntry_t *slot = qfs_dir_slot(d, d->block, s);
+        if (qfs_dir_names_match(slot, name)) {
+            memset(slot, 0, sizeof(direntry_t));
+            if (qfs_dir_write_block(d, (uint16_t)block, d->block) != 0) return -1;
+            d->header.entry_count--;
+            return qfs_dir_save_header(d);
+        }
+    }
+    return -1;
+}
+
+// Copies the next entry in bucket order into `entry`. Returns 0 at the end.
+static inline int qfs_dir_next(qfs_dir_t *d, qfs_dir_iter_t *iter, direntry_t *entry) {
+    if (!(d->sb->flags & QFS_SB_HASHED_DIR)) return 0;
+    if (!d->loaded && qfs_dir_load(d) != 0) return -1;
+    while (iter->ordinal < d->header.bucket_count) {
+        if (iter->slot == 0 && qfs_dir_read_block(d, d->buckets[iter->ordinal], d->block) != 0) {
+            return -1;
+        }
+        while (iter->slot < d->slots) {
+            direntry_t *slot = qfs_dir_slot(d, d->block, iter->slot++);
+            if (slot->filename[0] != '\0') {
+                memcpy(entry, slot, sizeof(direntry_t));
+                return 1;
+            }
+        }
+        iter->ordinal++;
+        iter->slot = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+**
+** O_DIRECT block I/O for the QFS (Quinnipiac File System)
+**
+** Usage: #define _GNU_SOURCE      (before any #include, for O_DIRECT)
+**        #include "qfs.h"
+**        #include "qfs_direct.h"
+**
+** Reads and writes of the data region go through an aligned bounce buffer that
+** holds one QFS_DIRECT_CHUNK window of the image. Whole windows are read and
+** only the dirty pages are written back, so the page cache is bypassed on raw
+** partitions without large recoveries evicting everything else. Each block's
+** 1-byte header and 2-byte footer are handled in memory by the caller.
+**
+** Writes only touch the pages they dirty. Pages never span an allocation
+** group, because groups start on QFS_DIRECT_ALIGN boundaries. So a writer
+** holding a group's lock never writes back another writer's blocks. Flush any
+** stdio stream on the same image before using the window, and again after
+** qfs_direct_flush(), so the two paths don't see each other's stale data.
+** Closing the descriptor drops every fcntl lock the process holds on the image,
+** so a tool holding locks must flush instead and close only when it is done.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define QFS_DIRECT_ALIGN  4096             // Alignment of buffers, offsets and lengths
+#define QFS_DIRECT_CHUNK  (256 * 1024)     // Bytes per aligned read
+#define QFS_DIRECT_PAGES  (QFS_DIRECT_CHUNK / QFS_DIRECT_ALIGN)
+
+typedef struct qfs_direct {
+    int      fd;                   // Image, opened with O_DIRECT if the file system allows it
+    uint8_t *buffer;               // Aligned bounce buffer of QFS_DIRECT_CHUNK bytes
+    long     window;               // Image offset held in the buffer, -1 if none
+    size_t   length;               // Bytes of the window that exist in the image
+    uint8_t  dirty[QFS_DIRECT_PAGES]; // Pages of the window written since it was read
+} qfs_direct_t;
+
+// Opens the image for O_DIRECT I/O, falling back to ordinary I/O if the file system refuses
+static inline int qfs_direct_open(qfs_direct_t *d, const char *path, int writable) {
+    memset(d, 0, sizeof(*d));
+    d->window = -1;
+    int flags = writable ? O_RDWR : O_RDONLY;
+    d->fd = open(path, flags | O_DIRECT);
+    if (d->fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "Warning: O_DIRECT not supported for %s, using the page cache\n", path);
+        d->fd = open(path, flags);
+    }
+    if (d->fd < 0) return -1;
+    if (posix_memalign((void **)&d->buffer, QFS_DIRECT_ALIGN, QFS_DIRECT_CHUNK) != 0) {
+        close(d->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes back the dirty pages of the current window, one write per run of pages
+static inline int qfs_direct_flush(qfs_direct_t *d) {
+    int page = 0;
+    while (page < QFS_DIRECT_PAGES) {
+        if (!d->dirty[page]) {
+            page++;
+            continue;
+        }
+        int end = page;
+        while (end < QFS_DIRECT_PAGES && d->dirty[end]) d->dirty[end++] = 0;
+        size_t start = (size_t)page * QFS_DIRECT_ALIGN;
+        size_t stop = (size_t)end * QFS_DIRECT_ALIGN;
+        if (stop > d->length) stop = d->length;
+        // A short last page at the end of the image can't be written with O_DIRECT
+        size_t aligned = (stop - start) & ~(size_t)(QFS_DIRECT_ALIGN - 1);
+        if (aligned > 0 &&
+            pwrite(d->fd, d->buffer + start, aligned, d->window + start) != (ssize_t)aligned) {
+            return -1;
+        }
+        if (start + aligned < stop) {
+            int flags = fcntl(d->fd, F_GETFL);
+            fcntl(d->fd, F_SETFL, flags & ~O_DIRECT);
+            ssize_t rc = pwrite(d->fd, d->buffer + start + aligned, stop - start - aligned,
+                                d->window + start + aligned);
+            fcntl(d->fd, F_SETFL, flags);
+            if (rc != (ssize_t)(stop - start - aligned)) return -1;
+        }
+        page = end;
+    }
+    return 0;
+}
+
+// Makes the aligned window holding `offset` current, reading it from the image
+static inline int qfs_direct_load(qfs_direct_t *d, long offset) {
+    long window = offset - (offset % QFS_DIRECT_CHUNK);
+    if (window == d->window) return 0;
+    if (qfs_direct_flush(d) != 0) return -1;
+    ssize_t got = pread(d->fd, d->buffer, QFS_DIRECT_CHUNK, window);
+    if (got < 0) return -1;
+    // Past the end of the image reads as zeros and is never written
+    memset(d->buffer + got, 0, QFS_DIRECT_CHUNK - got);
+    d->window = window;
+    d->length = got;
+    return 0;
+}
+
+// Copies `length` bytes at image offset `offset` out of the aligned windows
+static inline int qfs_direct_read(qfs_direct_t *d, long offset, void *dst, size_t length) {
+    uint8_t *out = dst;
+    while (length > 0) {
+        if (qfs_direct_load(d, offset) != 0) return -1;
+        size_t start = offset - d->window;
+        if (start >= d->length) return -1;
+        size_t n = d->length - start < length ? d->length - start : length;
+        memcpy(out, d->buffer + start, n);
+        out += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Copies `length` bytes into the aligned windows at image offset `offset`
+static inline int qfs_direct_write(qfs_direct_t *d, long offset, const void *src, size_t length) {
+    const uint8_t *in = src;
+    while (length > 0) {
+        if (qfs_direct_load(d, offset) != 0) return -1;
+        size_t start = offset - d->window;
+        if (start >= d->length) return -1;
+        size_t n = d->length - start < length ? d->length - start : length;
+        memcpy(d->buffer + start, in, n);
+        for (size_t page = start / QFS_DIRECT_ALIGN; page <= (start + n - 1) / QFS_DIRECT_ALIGN; page++) {
+            d->dirty[page] = 1;
+        }
+        in += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Flushes the window and closes the image
+static inline int qfs_direct_close(qfs_direct_t *d) {
+    int rc = qfs_direct_flush(d);
+    if (close(d->fd) != 0) rc = -1;
+    free(d->buffer);
+    d->buffer = NULL;
+    return rc;
+}
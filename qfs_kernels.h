@@ -0,0 +1,129 @@
+/*
+**
+** Block kernels for the QFS (Quinnipiac File System), specialized for the
+** block sizes mkfs_qfs produces
+**
+** Usage: #include "qfs.h"
+**        #include "qfs_kernels.h"
+**
+**   const qfs_kernels_t *kernels = qfs_select_kernels(sb.bytes_per_block);
+**   kernels->copy_data(out, blocks, count, sb.bytes_per_block);
+**
+** Each kernel is written once for any block size. The 512, 1024 and 2048 byte
+** versions call it with the size as a constant, so the compiler sees a fixed
+** stride and data area length and can unroll and vectorize the loops. The
+** table is picked once, after the superblock is read. Other block sizes use
+** the generic version.
+**
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#define QFS_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define QFS_ALWAYS_INLINE inline
+#endif
+
+#define QFS_CHECKSUM_SEED  0xcbf29ce484222325ULL
+#define QFS_CHECKSUM_PRIME 0x100000001b3ULL
+
+// Block kernels for one block size
+typedef struct qfs_kernels {
+    uint16_t bytes_per_block;      // Block size the kernels are specialized for (0 = any)
+    // Copies the data areas of `count` consecutive blocks in `blocks` to `dst`
+    void     (*copy_data)(uint8_t *dst, const uint8_t *blocks, size_t count, uint16_t bytes_per_block);
+    // Gathers the busy byte of `count` consecutive blocks in `blocks` into `busy`
+    void     (*scan_busy)(uint8_t *busy, const uint8_t *blocks, size_t count, uint16_t bytes_per_block);
+    // Returns a 64-bit checksum of a whole block
+    uint64_t (*checksum)(const uint8_t *block, uint16_t bytes_per_block);
+} qfs_kernels_t;
+
+static QFS_ALWAYS_INLINE void qfs_copy_data(uint8_t *dst, const uint8_t *blocks, size_t count,
+                                            uint16_t bytes_per_block) {
+    size_t data_size = bytes_per_block - 3;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(dst + i * data_size, blocks + i * bytes_per_block + 1, data_size);
+    }
+}
+
+static QFS_ALWAYS_INLINE void qfs_scan_busy(uint8_t *busy, const uint8_t *blocks, size_t count,
+                                            uint16_t bytes_per_block) {
+    for (size_t i = 0; i < count; i++) {
+        busy[i] = blocks[i * bytes_per_block];
+    }
+}
+
+// Four independent multiply-xor lanes over 64-bit words, so consecutive words
+// don't wait on each other. Bytes past the last whole group of four words fold
+// into the first lane.
+static QFS_ALWAYS_INLINE uint64_t qfs_checksum(const uint8_t *block, uint16_t bytes_per_block) {
+    uint64_t lane[4] = { QFS_CHECKSUM_SEED, QFS_CHECKSUM_SEED ^ 1,
+                         QFS_CHECKSUM_SEED ^ 2, QFS_CHECKSUM_SEED ^ 3 };
+    size_t groups = bytes_per_block / 32;
+    for (size_t i = 0; i < groups; i++) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, block + i * 32 + j * 8, sizeof(word));
+            lane[j] = (lane[j] ^ word) * QFS_CHECKSUM_PRIME;
+        }
+    }
+    for (size_t i = groups * 32; i < bytes_per_block; i++) {
+        lane[0] = (lane[0] ^ block[i]) * QFS_CHECKSUM_PRIME;
+    }
+    uint64_t hash = QFS_CHECKSUM_SEED;
+    for (int j = 0; j < 4; j++) {
+        hash = (hash ^ lane[j]) * QFS_CHECKSUM_PRIME;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Defines the kernels for one block size, passing it as a constant
+#define QFS_SPECIALIZE_KERNELS(BPB) \
+    static inline void qfs_copy_data_##BPB(uint8_t *dst, const uint8_t *blocks, size_t count, \
+                                           uint16_t bytes_per_block) { \
+        (void)bytes_per_block; \
+        qfs_copy_data(dst, blocks, count, BPB); \
+    } \
+    static inline void qfs_scan_busy_##BPB(uint8_t *busy, const uint8_t *blocks, size_t count, \
+                                           uint16_t bytes_per_block) { \
+        (void)bytes_per_block; \
+        qfs_scan_busy(busy, blocks, count, BPB); \
+    } \
+    static inline uint64_t qfs_checksum_##BPB(const uint8_t *block, uint16_t bytes_per_block) { \
+        (void)bytes_per_block; \
+        return qfs_checksum(block, BPB); \
+    }
+
+QFS_SPECIALIZE_KERNELS(512)
+QFS_SPECIALIZE_KERNELS(1024)
+QFS_SPECIALIZE_KERNELS(2048)
+
+static inline void qfs_copy_data_any(uint8_t *dst, const uint8_t *blocks, size_t count,
+                                     uint16_t bytes_per_block) {
+    qfs_copy_data(dst, blocks, count, bytes_per_block);
+}
+
+static inline void qfs_scan_busy_any(uint8_t *busy, const uint8_t *blocks, size_t count,
+                                     uint16_t bytes_per_block) {
+    qfs_scan_busy(busy, blocks, count, bytes_per_block);
+}
+
+static inline uint64_t qfs_checksum_any(const uint8_t *block, uint16_t bytes_per_block) {
+    return qfs_checksum(block, bytes_per_block);
+}
+
+// Returns the kernels specialized for a block size, or the generic ones
+static inline const qfs_kernels_t *qfs_select_kernels(uint16_t bytes_per_block) {
+    static const qfs_kernels_t kernels[] = {
+        { 512,  qfs_copy_data_512,  qfs_scan_busy_512,  qfs_checksum_512  },
+        { 1024, qfs_copy_data_1024, qfs_scan_busy_1024, qfs_checksum_1024 },
+        { 2048, qfs_copy_data_2048, qfs_scan_busy_2048, qfs_checksum_2048 },
+        { 0,    qfs_copy_data_any,  qfs_scan_busy_any,  qfs_checksum_any  },
+    };
+    int i = 0;
+    while (kernels[i].bytes_per_block != 0 && kernels[i].bytes_per_block != bytes_per_block) i++;
+    return &kernels[i];
+}
@@ -0,0 +1,429 @@
+/*
+ * qfs_replay.c
+ * Program that replays an operation trace recorded by the QFS tools against a
+ * freshly formatted image and reports latency percentiles and fragmentation
+ * CSC520 - Operating Systems
+ * Group: Aleena Graveline, Jean LaFrance, Horacio Valdes, Matthew Glennon
+ *
+ * Usage: qfs_replay [-m] [-t] <trace file> <disk image file>
+ *   -m  Replay at maximum speed instead of the trace's original pacing
+ *   -t  Replay writes with tail packing (write_file -t)
+ *
+ * Record a trace by setting QFS_TRACE=<trace file> while running write_file,
+ * read_file and delete_file (see qfs_trace.h). The disk image must already
+ * exist at the wanted size; it is reformatted with mkfs_qfs before the replay.
+ * The tools are run from the directory qfs_replay lives in, and each written
+ * file is synthesized at its traced size in a scratch directory. Traced names
+ * are made relative to the scratch directory: leading slashes are dropped and
+ * names with ".." components are skipped, so a replay never touches files
+ * outside it.
+ *
+ * Replayed latencies are the ones each tool records in its own trace, measured
+ * the same way as the traced ones, so process start-up isn't counted in either.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "qfs_trace.h"
+
+#define OP_WRITE  0
+#define OP_READ   1
+#define OP_DELETE 2
+#define OP_TYPES  3
+
+static const char *op_names[OP_TYPES] = { "write", "read", "delete" };
+
+// One traced operation
+typedef struct traceop {
+    uint64_t start_us;             // Wall clock start time in the trace
+    int      type;                 // OP_WRITE, OP_READ or OP_DELETE
+    uint64_t latency_us;           // Latency recorded in the trace
+    uint64_t size;                 // File size in bytes
+    char     name[256];            // File name in the image, relative to the scratch directory
+} traceop_t;
+
+// Latencies collected for one operation type
+typedef struct latencies {
+    uint64_t *replayed;            // In-tool latency of each successful replayed operation
+    uint64_t *traced;              // Latency the trace recorded for the same operations
+    size_t    count;
+    size_t    failed;
+} latencies_t;
+
+static char tool_dir[PATH_MAX];
+
+// Runs a QFS tool from tool_dir and waits for it. Its stdout goes to `out_fd`
+// (or /dev/null when -1) and its stderr to /dev/null. Returns the exit status.
+static int run_tool(const char *tool, char *args[], int out_fd) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", tool_dir, tool);
+    args[0] = path;
+
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(out_fd >= 0 ? out_fd : null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(path, args);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+// Makes a traced name relative by dropping leading slashes. Returns -1 for a
+// name that would still leave the scratch directory or is empty.
+static int scratch_name(char *name) {
+    size_t skip = strspn(name, "/");
+    memmove(name, name + skip, strlen(name + skip) + 1);
+    if (name[0] == '\0') return -1;
+    for (const char *part = name; part; part = strchr(part, '/')) {
+        if (*part == '/') part++;
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) return -1;
+    }
+    return 0;
+}
+
+// Removes the file make_file created and any directories it made for it
+static void remove_file(const char *name) {
+    char dirs[256];
+    strncpy(dirs, name, sizeof(dirs) - 1);
+    dirs[sizeof(dirs) - 1] = '\0';
+    unlink(dirs);
+    for (char *slash = strrchr(dirs, '/'); slash; slash = strrchr(dirs, '/')) {
+        *slash = '\0';
+        if (rmdir(dirs) != 0) break;
+    }
+}
+
+// Creates a JPG or PNG (picked by extension) of `size` bytes that write_file accepts.
+// The name must already have gone through scratch_name.
+static int make_file(const char *name, uint64_t size) {
+    // Create any directories in the name, as the traced tool was run from its parent
+    char dirs[256];
+    strncpy(dirs, name, sizeof(dirs) - 1);
+    dirs[sizeof(dirs) - 1] = '\0';
+    for (char *slash = strchr(dirs + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dirs, 0755);
+        *slash = '/';
+    }
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!fp) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const char *ext = strrchr(name, '.');
+    int is_jpg = ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0);
+    static const uint8_t png[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+    static const uint8_t jpg[2] = { 0xFF, 0xD8 };
+    static const uint8_t jpg_end[2] = { 0xFF, 0xD9 };
+    const uint8_t *header = is_jpg ? jpg : png;
+    uint64_t header_len = is_jpg ? sizeof(jpg) : sizeof(png);
+
+    uint8_t buffer[4096] = {0};
+    uint64_t written = 0;
+    fwrite(header, 1, size < header_len ? size : header_len, fp);
+    written += size < header_len ? size : header_len;
+    uint64_t body_end = (is_jpg && size >= 4) ? size - sizeof(jpg_end) : size;
+    while (written < body_end) {
+        size_t n = body_end - written < sizeof(buffer) ? body_end - written : sizeof(buffer);
+        fwrite(buffer, 1, n, fp);
+        written += n;
+    }
+    if (written < size) fwrite(jpg_end, 1, sizeof(jpg_end), fp);
+    return fclose(fp);
+}
+
+// Reads the latency from the single line a tool appended to an empty trace file
+static int read_tool_latency(const char *path, uint64_t *latency) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    unsigned long long start, value;
+    char op[16];
+    int rc = fscanf(fp, "%llu %15s %llu", &start, op, &value) == 3 ? 0 : -1;
+    fclose(fp);
+    if (rc == 0) *latency = value;
+    return rc;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t rank = (size_t)(p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+// Loads a trace file, returning the number of operations read. Operations on
+// names that can't be kept inside the scratch directory are counted in `skipped`.
+static size_t load_trace(const char *path, traceop_t **ops_out, size_t *skipped) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    size_t count = 0, capacity = 256;
+    traceop_t *ops = malloc(sizeof(traceop_t) * capacity);
+    char line[512];
+    while (ops && fgets(line, sizeof(line), fp)) {
+        unsigned long long start, latency, size;
+        char op[16];
+        int name_at = 0;
+        if (sscanf(line, "%llu %15s %llu %llu %n", &start, op, &latency, &size, &name_at) != 4 ||
+            name_at == 0) {
+            continue;
+        }
+        int type = -1;
+        for (int t = 0; t < OP_TYPES; t++) {
+            if (strcmp(op, op_names[t]) == 0) type = t;
+        }
+        if (type < 0) continue;
+
+        if (count == capacity) {
+            capacity *= 2;
+            traceop_t *grown = realloc(ops, sizeof(traceop_t) * capacity);
+            if (!grown) break;
+            ops = grown;
+        }
+        traceop_t *entry = &ops[count];
+        entry->start_us = start;
+        entry->type = type;
+        entry->latency_us = latency;
+        entry->size = size;
+        strncpy(entry->name, line + name_at, sizeof(entry->name) - 1);
+        entry->name[sizeof(entry->name) - 1] = '\0';
+        entry->name[strcspn(entry->name, "\r\n")] = '\0';
+        if (scratch_name(entry->name) != 0) {
+            (*skipped)++;
+            continue;
+        }
+        count++;
+    }
+    fclose(fp);
+    *ops_out = ops;
+    return ops ? count : 0;
+}
+
+// Runs list_information --analyze on the image and summarizes its CSV output
+static void report_fragmentation(char *image) {
+    char *args[] = { NULL, "--analyze", "--format=csv", image, NULL };
+
+    // Capture the output in a temporary file, then parse it
+    FILE *out = tmpfile();
+    if (!out) return;
+    int rc = run_tool("list_information", args, fileno(out));
+    if (rc != 0) {
+        fprintf(stderr, "list_information failed on %s\n", image);
+        fclose(out);
+        return;
+    }
+    rewind(out);
+
+    // File rows come first, then a blank line, the free-extent histogram, a blank
+    // line and the free-space summary
+    char line[512];
+    int section = 0, header = 1;
+    unsigned long files = 0, fragmented = 0, blocks = 0, runs = 0;
+    double seek_total = 0;
+    unsigned long free_blocks = 0, extents = 0, largest = 0;
+    while (fgets(line, sizeof(line), out)) {
+        if (line[0] == '\n') {
+            section++;
+            header = 1;
+            continue;
+        }
+        if (header) {
+            header = 0;
+            continue;
+        }
+        if (section == 0) {
+            // The name may contain commas, so parse the numeric columns from the end
+            char *field[6];
+            int found = 0;
+            for (char *p = line + strlen(line); p > line && found < 6; p--) {
+                if (*p == ',') field[found++] = p + 1;
+            }
+            if (found < 6) continue;
+            unsigned long file_blocks = strtoul(field[2], NULL, 10);
+            unsigned long file_runs = strtoul(field[1], NULL, 10);
+            files++;
+            blocks += file_blocks;
+            runs += file_runs;
+            if (file_runs > 1) fragmented++;
+            seek_total += strtod(field[0], NULL);
+        } else if (section == 2) {
+            sscanf(line, "%lu,%lu,%lu", &free_blocks, &extents, &largest);
+        }
+    }
+    fclose(out);
+
+    printf("\nFragmentation\n");
+    printf("Files: %lu (%lu fragmented)\n", files, fragmented);
+    printf("Blocks in use by files: %lu\n", blocks);
+    printf("Average Runs per File: %.2f\n", files ? (double)runs / files : 0.0);
+    printf("Average Seek Distance: %.2f blocks\n", files ? seek_total / files : 0.0);
+    printf("Free Blocks: %lu in %lu extents, largest %lu\n", free_blocks, extents, largest);
+}
+
+int main(int argc, char *argv[]) {
+    int max_speed = 0, tail_mode = 0, arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-m") == 0) max_speed = 1;
+        else if (strcmp(argv[arg], "-t") == 0) tail_mode = 1;
+        else break;
+    }
+    if (argc - arg != 2 || argv[arg][0] == '-') {
+        fprintf(stderr, "Usage: %s [-m] [-t] <trace file> <disk image file>\n", argv[0]);
+        return 1;
+    }
+
+    // Tools live next to qfs_replay; the scratch directory needs absolute paths
+    char self[PATH_MAX];
+    ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (self_len <= 0) {
+        fprintf(stderr, "Failed to locate qfs_replay\n");
+        return 2;
+    }
+    self[self_len] = '\0';
+    strncpy(tool_dir, dirname(self), sizeof(tool_dir) - 1);
+
+    char image[PATH_MAX];
+    if (!realpath(argv[arg + 1], image)) {
+        perror("realpath");
+        return 2;
+    }
+
+    traceop_t *ops = NULL;
+    size_t skipped = 0;
+    size_t op_count = load_trace(argv[arg], &ops, &skipped);
+    if (skipped > 0) {
+        fprintf(stderr, "Skipped %zu operations on names outside the scratch directory\n", skipped);
+    }
+    if (op_count == 0) {
+        fprintf(stderr, "No operations found in trace %s\n", argv[arg]);
+        free(ops);
+        return 3;
+    }
+
+    char *mkfs_args[] = { NULL, image, "replay", NULL };
+    if (run_tool("mkfs_qfs", mkfs_args, -1) != 0) {
+        fprintf(stderr, "Failed to format %s\n", image);
+        free(ops);
+        return 4;
+    }
+
+    char scratch[] = "/tmp/qfs_replay.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror("mkdtemp");
+        free(ops);
+        return 5;
+    }
+
+    // The tools trace themselves into the scratch directory, one operation at a time
+    char tool_trace[sizeof(scratch) + 16];
+    snprintf(tool_trace, sizeof(tool_trace), "%s/replay.trace", scratch);
+    setenv(QFS_TRACE_ENV, tool_trace, 1);
+
+    latencies_t stats[OP_TYPES];
+    for (int t = 0; t < OP_TYPES; t++) {
+        stats[t].replayed = malloc(sizeof(uint64_t) * op_count);
+        stats[t].traced = malloc(sizeof(uint64_t) * op_count);
+        stats[t].count = 0;
+        stats[t].failed = 0;
+        if (!stats[t].replayed || !stats[t].traced) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 6;
+        }
+    }
+
+    uint64_t replay_start = qfs_trace_clock(CLOCK_MONOTONIC);
+    for (size_t i = 0; i < op_count; i++) {
+        traceop_t *op = &ops[i];
+
+        // Keep the trace's spacing between operations unless running flat out
+        if (!max_speed && op->start_us > ops[0].start_us) {
+            uint64_t due = op->start_us - ops[0].start_us;
+            uint64_t elapsed = qfs_trace_clock(CLOCK_MONOTONIC) - replay_start;
+            if (due > elapsed) {
+                struct timespec wait = { (time_t)((due - elapsed) / 1000000),
+                                         (long)((due - elapsed) % 1000000) * 1000 };
+                nanosleep(&wait, NULL);
+            }
+        }
+
+        if (op->type == OP_WRITE && make_file(op->name, op->size) != 0) {
+            stats[op->type].failed++;
+            continue;
+        }
+
+        // Without -t, the write arguments start one later; run_tool fills in slot 0
+        char *write_args[] = { NULL, "-t", image, op->name, NULL };
+        char *read_args[] = { NULL, image, op->name, "/dev/null", NULL };
+        char *delete_args[] = { NULL, image, op->name, NULL };
+        unlink(tool_trace);
+        int rc;
+        if (op->type == OP_WRITE) {
+            rc = run_tool("write_file", tail_mode ? write_args : write_args + 1, -1);
+        } else if (op->type == OP_READ) {
+            rc = run_tool("read_file", read_args, -1);
+        } else {
+            rc = run_tool("delete_file", delete_args, -1);
+        }
+        uint64_t latency = 0;
+        if (rc == 0 && read_tool_latency(tool_trace, &latency) != 0) rc = -1;
+        if (op->type == OP_WRITE) remove_file(op->name);
+
+        latencies_t *s = &stats[op->type];
+        if (rc != 0) {
+            s->failed++;
+            continue;
+        }
+        s->replayed[s->count] = latency;
+        s->traced[s->count] = op->latency_us;
+        s->count++;
+    }
+    uint64_t replay_time = qfs_trace_clock(CLOCK_MONOTONIC) - replay_start;
+
+    printf("Replayed %zu operations in %.3f s (%s)\n", op_count, replay_time / 1e6,
+           max_speed ? "maximum speed" : "original pacing");
+    printf("\nIn-tool latency (us)        count  failed      p50      p90      p99      max   traced p50  traced p99\n");
+    for (int t = 0; t < OP_TYPES; t++) {
+        latencies_t *s = &stats[t];
+        qsort(s->replayed, s->count, sizeof(uint64_t), compare_u64);
+        qsort(s->traced, s->count, sizeof(uint64_t), compare_u64);
+        printf("%-24s %8zu %7zu %8llu %8llu %8llu %8llu %12llu %11llu\n", op_names[t], s->count, s->failed,
+               (unsigned long long)percentile(s->replayed, s->count, 50),
+               (unsigned long long)percentile(s->replayed, s->count, 90),
+               (unsigned long long)percentile(s->replayed, s->count, 99),
+               (unsigned long long)(s->count ? s->replayed[s->count - 1] : 0),
+               (unsigned long long)percentile(s->traced, s->count, 50),
+               (unsigned long long)percentile(s->traced, s->count, 99));
+        free(s->replayed);
+        free(s->traced);
+    }
+
+    unlink(tool_trace);
+    report_fragmentation(image);
+
+    if (chdir("/") == 0) rmdir(scratch);
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * qfs_sync.c
+ * Program that replicates a QFS image incrementally by emitting and applying a
+ * delta of only the blocks and metadata that changed
+ * CSC520 - Operating Systems
+ * Group: Aleena Graveline, Jean LaFrance, Horacio Valdes, Matthew Glennon
+ *
+ * Usage:
+ *   qfs_sync diff <source image> <target image> <delta file|->
+ *   qfs_sync apply <delta file|-> <target image>
+ *
+ * "diff" compares the superblock and directory table of both images and hashes
+ * every data block of both in parallel, then writes a delta that turns the target
+ * into a copy of the source. "apply" checks the delta, and that the target is the
+ * image the delta was made against, and writes it into the target. A target the
+ * delta was already applied to is left alone. One that an interrupted apply left
+ * partly written is recognized by the old checksum each record carries, and the
+ * apply is resumed.
+ *
+ * "diff" reads the target, so to replicate to another host keep a local copy of
+ * the image as last synced and apply each delta to both. Use "-" to write the
+ * delta to stdout or read it from stdin, for example:
+ *   qfs_sync diff disk.img synced.img delta &&
+ *   ssh standby qfs_sync apply - disk.img < delta && qfs_sync apply delta synced.img
+ *
+ * Delta layout (little-endian):
+ *   delta header, metadata region (if changed), one record per changed block
+ *   (uint16_t block number, uint64_t checksum of the target's block, then the
+ *   whole block), uint64_t FNV-1a checksum of everything before it
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "qfs.h"
+#include "qfs_kernels.h"
+
+#define DELTA_MAGIC    0x44534651  // "QFSD"
+#define DELTA_VERSION  3
+#define MAX_THREADS    16
+#define HASH_CHUNK     256         // Blocks read per pread when hashing
+
+#define FNV_OFFSET     0xcbf29ce484222325ULL
+#define FNV_PRIME      0x100000001b3ULL
+
+#pragma pack(push,1)
+
+// Delta file header
+typedef struct deltaheader {
+    uint32_t magic;                // DELTA_MAGIC
+    uint8_t  version;              // DELTA_VERSION
+    uint16_t bytes_per_block;      // Block size of both images
+    uint16_t total_blocks;         // Block count of both images
+    uint16_t metadata_length;      // Bytes of superblock + directory table that follow (0 = unchanged)
+    uint32_t block_count;          // Number of changed block records that follow
+    uint64_t target_hash;          // Fingerprint of the target the delta was made against
+    uint64_t result_hash;          // Fingerprint of the target once the delta is applied
+    uint64_t metadata_hash;        // Hash of the target's metadata region
+} deltaheader_t;
+
+#pragma pack(pop)
+
+// Range of blocks hashed by one thread
+typedef struct hashjob {
+    int       fd;                  // Image to read
+    long      data_start;          // Byte offset of block 0
+    uint16_t  bytes_per_block;
+    uint32_t  first;               // First block of the range
+    uint32_t  count;               // Number of blocks in the range
+    const qfs_kernels_t *kernels;  // Block kernels for the image's block size
+    uint64_t *hashes;              // Output, indexed by block number
+    int       error;               // Set if a read failed
+} hashjob_t;
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hashes each block of a job's range, reading HASH_CHUNK blocks at a time
+static void *hash_blocks(void *arg) {
+    hashjob_t *job = arg;
+    uint8_t *buffer = malloc((size_t)HASH_CHUNK * job->bytes_per_block);
+    if (!buffer) {
+        job->error = 1;
+        return NULL;
+    }
+    for (uint32_t done = 0; done < job->count; ) {
+        uint32_t n = job->count - done < HASH_CHUNK ? job->count - done : HASH_CHUNK;
+        size_t length = (size_t)n * job->bytes_per_block;
+        off_t offset = job->data_start + (off_t)(job->first + done) * job->bytes_per_block;
+        if (pread(job->fd, buffer, length, offset) != (ssize_t)length) {
+            job->error = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            job->hashes[job->first + done + i] =
+                job->kernels->checksum(buffer + (size_t)i * job->bytes_per_block, job->bytes_per_block);
+        }
+        done += n;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Hashes every data block of `count` images using a shared pool of threads
+static int hash_images(const int *fds, int count, long data_start, const superblock_t *sb,
+                       uint64_t **hashes) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long share = cpus / count;
+    int per_image = (share < 1) ? 1 : (share > MAX_THREADS / count ? MAX_THREADS / count : share);
+    hashjob_t jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int threaded[MAX_THREADS];
+    int started = 0;
+
+    const qfs_kernels_t *kernels = qfs_select_kernels(sb->bytes_per_block);
+    uint32_t per_job = (sb->total_blocks + per_image - 1) / per_image;
+    for (int img = 0; img < count; img++) {
+        for (int t = 0; t < per_image; t++) {
+            uint32_t first = t * per_job;
+            if (first >= sb->total_blocks) break;
+            hashjob_t *job = &jobs[started];
+            job->fd = fds[img];
+            job->data_start = data_start;
+            job->bytes_per_block = sb->bytes_per_block;
+            job->kernels = kernels;
+            job->first = first;
+            job->count = (sb->total_blocks - first < per_job) ? sb->total_blocks - first : per_job;
+            job->hashes = hashes[img];
+            job->error = 0;
+            // Fall back to hashing inline if a thread can't be started
+            threaded[started] = pthread_create(&threads[started], NULL, hash_blocks, job) == 0;
+            if (!threaded[started]) hash_blocks(job);
+            started++;
+        }
+    }
+
+    int error = 0;
+    for (int i = 0; i < started; i++) {
+        if (threaded[i]) pthread_join(threads[i], NULL);
+        error |= jobs[i].error;
+    }
+    return error;
+}
+
+// Identifies an image by the hash of its metadata region and of every data block
+static uint64_t image_fingerprint(uint64_t metadata_hash, const uint64_t *hashes,
+                                  uint32_t total_blocks) {
+    uint64_t hash = fnv1a(FNV_OFFSET, (const uint8_t *)&metadata_hash, sizeof(metadata_hash));
+    return fnv1a(hash, (const uint8_t *)hashes, sizeof(uint64_t) * total_blocks);
+}
+
+// Writes to the delta and folds the bytes into its running checksum
+static int delta_write(FILE *out, uint64_t *checksum, const void *data, size_t length) {
+    *checksum = fnv1a(*checksum, data, length);
+    return fwrite(data, 1, length, out) == length;
+}
+
+static int do_diff(const char *source_name, const char *target_name, const char *delta_name) {
+    int fds[2];
+    fds[0] = open(source_name, O_RDONLY);
+    if (fds[0] < 0) {
+        perror("open");
+        return 2;
+    }
+    fds[1] = open(target_name, O_RDONLY);
+    if (fds[1] < 0) {
+        perror("open");
+        close(fds[0]);
+        return 2;
+    }
+
+    superblock_t sb[2];
+    for (int img = 0; img < 2; img++) {
+        if (pread(fds[img], &sb[img], sizeof(superblock_t), 0) != sizeof(superblock_t) ||
+            sb[img].fs_type != 0x51 || sb[img].bytes_per_block < 3) {
+            fprintf(stderr, "Invalid file system in %s\n", img ? target_name : source_name);
+            close(fds[0]);
+            close(fds[1]);
+            return 3;
+        }
+    }
+    if (sb[0].bytes_per_block != sb[1].bytes_per_block ||
+        sb[0].total_blocks != sb[1].total_blocks ||
+        sb[0].total_direntries != sb[1].total_direntries) {
+        fprintf(stderr, "Images have different geometry, a full copy is required\n");
+        close(fds[0]);
+        close(fds[1]);
+        return 4;
+    }
+
+    // Compare the superblock and directory table as one metadata region
+    long data_start = sizeof(superblock_t) + (sb[0].total_direntries * sizeof(direntry_t));
+    uint8_t *metadata[2] = { malloc(data_start), malloc(data_start) };
+    uint64_t *hashes[2] = { malloc(sizeof(uint64_t) * sb[0].total_blocks),
+                            malloc(sizeof(uint64_t) * sb[0].total_blocks) };
+    uint8_t *block = malloc(sb[0].bytes_per_block);
+    if (!metadata[0] || !metadata[1] || !hashes[0] || !hashes[1] || !block) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 5;
+    }
+    for (int img = 0; img < 2; img++) {
+        if (pread(fds[img], metadata[img], data_start, 0) != data_start) {
+            fprintf(stderr, "Failed to read directory table\n");
+            return 6;
+        }
+    }
+    int metadata_changed = memcmp(metadata[0], metadata[1], data_start) != 0;
+
+    if (hash_images(fds, 2, data_start, &sb[0], hashes) != 0) {
+        fprintf(stderr, "Failed to read data blocks\n");
+        return 6;
+    }
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < sb[0].total_blocks; i++) {
+        if (hashes[0][i] != hashes[1][i]) changed++;
+    }
+
+    FILE *out = strcmp(delta_name, "-") == 0 ? stdout : fopen(delta_name, "wb");
+    if (!out) {
+        perror("fopen");
+        return 7;
+    }
+
+    deltaheader_t header;
+    header.magic = DELTA_MAGIC;
+    header.version = DELTA_VERSION;
+    header.bytes_per_block = sb[0].bytes_per_block;
+    header.total_blocks = sb[0].total_blocks;
+    header.metadata_length = metadata_changed ? (uint16_t)data_start : 0;
+    header.block_count = changed;
+    header.metadata_hash = fnv1a(FNV_OFFSET, metadata[1], data_start);
+    header.target_hash = image_fingerprint(header.metadata_hash, hashes[1], sb[1].total_blocks);
+    header.result_hash = image_fingerprint(fnv1a(FNV_OFFSET, metadata[0], data_start),
+                                           hashes[0], sb[0].total_blocks);
+
+    uint64_t checksum = FNV_OFFSET;
+    int ok = delta_write(out, &checksum, &header, sizeof(header));
+    if (metadata_changed) ok = ok && delta_write(out, &checksum, metadata[0], data_start);
+    for (uint32_t i = 0; ok && i < sb[0].total_blocks; i++) {
+        if (hashes[0][i] == hashes[1][i]) continue;
+        uint16_t block_number = (uint16_t)i;
+        off_t offset = data_start + (off_t)i * sb[0].bytes_per_block;
+        if (pread(fds[0], block, sb[0].bytes_per_block, offset) != sb[0].bytes_per_block) {
+            fprintf(stderr, "Failed to read block %u\n", i);
+            ok = 0;
+            break;
+        }
+        ok = delta_write(out, &checksum, &block_number, sizeof(block_number)) &&
+             delta_write(out, &checksum, &hashes[1][i], sizeof(uint64_t)) &&
+             delta_write(out, &checksum, block, sb[0].bytes_per_block);
+    }
+    ok = ok && fwrite(&checksum, sizeof(checksum), 1, out) == 1;
+    ok = (fflush(out) == 0) && ok;
+    if (out != stdout) fclose(out);
+
+#ifdef DEBUG
+    fprintf(stderr, "Metadata changed: %s, blocks changed: %u of %u\n",
+            metadata_changed ? "yes" : "no", changed, sb[0].total_blocks);
+#endif
+
+    free(block);
+    free(hashes[0]);
+    free(hashes[1]);
+    free(metadata[0]);
+    free(metadata[1]);
+    close(fds[0]);
+    close(fds[1]);
+    if (!ok) {
+        fprintf(stderr, "Failed to write delta\n");
+        return 8;
+    }
+    return 0;
+}
+
+static int do_apply(const char *delta_name, const char *target_name) {
+    FILE *in = strcmp(delta_name, "-") == 0 ? stdin : fopen(delta_name, "rb");
+    if (!in) {
+        perror("fopen");
+        return 2;
+    }
+
+    // Load the whole delta so nothing is written unless its checksum matches
+    size_t length = 0, capacity = 1 << 16;
+    uint8_t *delta = malloc(capacity);
+    while (delta) {
+        length += fread(delta + length, 1, capacity - length, in);
+        if (length < capacity) break;
+        capacity *= 2;
+        uint8_t *grown = realloc(delta, capacity);
+        if (!grown) free(delta);
+        delta = grown;
+    }
+    if (in != stdin) fclose(in);
+    if (!delta) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 5;
+    }
+
+    deltaheader_t header;
+    uint64_t checksum;
+    if (length < sizeof(header) + sizeof(checksum)) {
+        fprintf(stderr, "Delta is truncated\n");
+        free(delta);
+        return 9;
+    }
+    memcpy(&header, delta, sizeof(header));
+    memcpy(&checksum, delta + length - sizeof(checksum), sizeof(checksum));
+    size_t record_length = sizeof(uint16_t) + sizeof(uint64_t) + header.bytes_per_block;
+    size_t expected = sizeof(header) + header.metadata_length +
+        (size_t)header.block_count * record_length + sizeof(checksum);
+    if (header.magic != DELTA_MAGIC || header.version != DELTA_VERSION || length != expected ||
+        fnv1a(FNV_OFFSET, delta, length - sizeof(checksum)) != checksum) {
+        fprintf(stderr, "Delta is corrupt or truncated\n");
+        free(delta);
+        return 9;
+    }
+
+    int fd = open(target_name, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        free(delta);
+        return 2;
+    }
+    superblock_t sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.fs_type != 0x51 ||
+        sb.bytes_per_block != header.bytes_per_block || sb.total_blocks != header.total_blocks) {
+        fprintf(stderr, "Target image does not match the delta's geometry\n");
+        close(fd);
+        free(delta);
+        return 4;
+    }
+    long data_start = sizeof(superblock_t) + (sb.total_direntries * sizeof(direntry_t));
+
+    uint8_t *records = delta + sizeof(header) + header.metadata_length;
+    uint8_t *metadata = malloc(data_start);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * sb.total_blocks);
+    if (!metadata || !hashes) {
+        fprintf(stderr, "Memory allocation failed\n");
+        close(fd);
+        free(delta);
+        return 5;
+    }
+    if (pread(fd, metadata, data_start, 0) != data_start ||
+        hash_images(&fd, 1, data_start, &sb, &hashes) != 0) {
+        fprintf(stderr, "Failed to read target image\n");
+        close(fd);
+        free(delta);
+        return 6;
+    }
+    uint64_t metadata_hash = fnv1a(FNV_OFFSET, metadata, data_start);
+    uint64_t fingerprint = image_fingerprint(metadata_hash, hashes, sb.total_blocks);
+    if (fingerprint == header.result_hash) {
+        printf("Target image already matches the delta\n");
+        free(metadata);
+        free(hashes);
+        close(fd);
+        free(delta);
+        return 0;
+    }
+
+    /*
+    ** Refuse a target other than the one the delta was made against; the blocks
+    ** the delta leaves alone would not match the source. An interrupted apply
+    ** leaves some of the delta written: put back the old checksum of every block,
+    ** and the old metadata hash, where the delta's version is already on disk. If
+    ** that gives the target's fingerprint, nothing else has changed since and
+    ** writing the whole delta again finishes the apply.
+    */
+    int matches = fingerprint == header.target_hash;
+    if (!matches) {
+        const qfs_kernels_t *kernels = qfs_select_kernels(sb.bytes_per_block);
+        uint8_t *record = records;
+        int valid = 1;
+        for (uint32_t i = 0; valid && i < header.block_count; i++) {
+            uint16_t block_number;
+            uint64_t old_hash;
+            memcpy(&block_number, record, sizeof(block_number));
+            memcpy(&old_hash, record + sizeof(block_number), sizeof(old_hash));
+            uint8_t *block = record + sizeof(block_number) + sizeof(old_hash);
+            valid = block_number < sb.total_blocks;
+            if (valid && hashes[block_number] == kernels->checksum(block, sb.bytes_per_block)) {
+                hashes[block_number] = old_hash;
+            }
+            record += record_length;
+        }
+        if (header.metadata_length == data_start &&
+            memcmp(metadata, delta + sizeof(header), data_start) == 0) {
+            metadata_hash = header.metadata_hash;
+        }
+        matches = valid && image_fingerprint(metadata_hash, hashes, sb.total_blocks) ==
+                           header.target_hash;
+    }
+    free(metadata);
+    free(hashes);
+    if (!matches) {
+        fprintf(stderr, "Target image is not the one the delta was made against\n");
+        close(fd);
+        free(delta);
+        return 11;
+    }
+
+    // Write data blocks first and the metadata that references them last
+    int ok = 1;
+    uint8_t *record = records;
+    for (uint32_t i = 0; ok && i < header.block_count; i++) {
+        uint16_t block_number;
+        memcpy(&block_number, record, sizeof(block_number));
+        off_t offset = data_start + (off_t)block_number * header.bytes_per_block;
+        ok = block_number < sb.total_blocks &&
+             pwrite(fd, record + sizeof(block_number) + sizeof(uint64_t), header.bytes_per_block,
+                    offset) == header.bytes_per_block;
+        record += record_length;
+    }
+    if (ok && header.metadata_length > 0) {
+        ok = pwrite(fd, delta + sizeof(header), header.metadata_length, 0) == header.metadata_length;
+    }
+    ok = (fsync(fd) == 0) && ok;
+
+    close(fd);
+    free(delta);
+    if (!ok) {
+        fprintf(stderr, "Failed to write target image\n");
+        return 10;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 5 && strcmp(argv[1], "diff") == 0) {
+        return do_diff(argv[2], argv[3], argv[4]);
+    }
+    if (argc == 4 && strcmp(argv[1], "apply") == 0) {
+        return do_apply(argv[2], argv[3]);
+    }
+    fprintf(stderr, "Usage: %s diff <source image> <target image> <delta file|->\n", argv[0]);
+    fprintf(stderr, "       %s apply <delta file|-> <target image>\n", argv[0]);
+    return 1;
+}
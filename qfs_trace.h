@@ -0,0 +1,63 @@
+/*
+**
+** Operation trace recorder for the QFS (Quinnipiac File System) tools
+**
+** Usage: #include "qfs_trace.h"
+**
+** When the QFS_TRACE environment variable names a file, each successful
+** write, read and delete appends one line to it:
+**
+**   <start time, microseconds since the epoch> <op> <latency, microseconds> <size> <name>
+**
+** The name is the rest of the line, so it may contain spaces. Each line goes
+** out in a single O_APPEND write, so several tools can trace into one file
+** at once. qfs_replay plays a trace back against a fresh image.
+**
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QFS_TRACE_ENV "QFS_TRACE"
+
+typedef struct qfs_trace {
+    uint64_t start_us;             // Wall clock time the operation started
+    uint64_t start_mono_us;        // Monotonic time the operation started
+} qfs_trace_t;
+
+static inline uint64_t qfs_trace_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Marks the start of an operation
+static inline void qfs_trace_begin(qfs_trace_t *trace) {
+    trace->start_us = qfs_trace_clock(CLOCK_REALTIME);
+    trace->start_mono_us = qfs_trace_clock(CLOCK_MONOTONIC);
+}
+
+// Appends the finished operation to the trace file, if tracing is on
+static inline void qfs_trace_end(const qfs_trace_t *trace, const char *op, uint64_t size,
+                                 const char *name) {
+    const char *path = getenv(QFS_TRACE_ENV);
+    if (!path || !*path) return;
+
+    uint64_t latency = qfs_trace_clock(CLOCK_MONOTONIC) - trace->start_mono_us;
+    char line[256];
+    int length = snprintf(line, sizeof(line), "%llu %s %llu %llu %s\n",
+                          (unsigned long long)trace->start_us, op,
+                          (unsigned long long)latency, (unsigned long long)size, name);
+    if (length <= 0 || length >= (int)sizeof(line)) return;
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) return;
+    if (write(fd, line, length) != length) {
+        fprintf(stderr, "Warning: failed to write trace to %s\n", path);
+    }
+    close(fd);
+}
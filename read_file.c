@@ -6,17 +6,37 @@
  * File worked on by: Aleena Graveline
  * 12/10/2025
  */
- 
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_kernels.h"
+#include "qfs_chain.h"
+#include "qfs_direct.h"
+#include "qfs_trace.h"
+
+//reads whole blocks through the O_DIRECT windows
+static uint32_t read_direct(void *direct, long offset, uint8_t *dst,
+                            uint16_t blockSize, uint32_t count)
+{
+	return qfs_direct_read(direct, offset, dst, (size_t)count * blockSize) == 0 ? count : 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to read> <output file>\n", argv[0]);
+    //-d reads the data blocks with O_DIRECT, bypassing the page cache
+    int directMode = (argc == 5 && strcmp(argv[1], "-d") == 0);
+    if (argc != 4 + directMode) {
+        fprintf(stderr, "Usage: %s [-d] <disk image file> <file to read> <output file>\n", argv[0]);
         return 1;
     }
+    argv += directMode;
+
+    qfs_trace_t trace;
+    qfs_trace_begin(&trace);
 
     FILE *fp = fopen(argv[1], "rb");
     if (!fp) {
@@ -24,6 +44,17 @@ int main(int argc, char *argv[]) {
         return 2;
     }
 
+    qfs_direct_t directIO;
+    qfs_direct_t *direct = NULL;
+    if (directMode) {
+        if (qfs_direct_open(&directIO, argv[1], 0) != 0) {
+            perror("open");
+            fclose(fp);
+            return 2;
+        }
+        direct = &directIO;
+    }
+
 #ifdef DEBUG
     printf("Opened disk image: %s\n", argv[1]);
 #endif
@@ -37,7 +68,7 @@ int main(int argc, char *argv[]) {
 	
 	//seek to beginning of directory entries
 	fseek(fp, 32, SEEK_SET);
-	uint16_t blockStart;
+	uint16_t entryIndex;
 	uint8_t found = 0;
 	direntry_t currentEntry;
 	
@@ -47,16 +78,33 @@ int main(int argc, char *argv[]) {
 		//read the directory entry at the current position
 		fread(&currentEntry, sizeof(direntry_t), 1, fp);
 		
-		//check if the directory entry is the requested file
-		if(strcmp(currentEntry.filename, argv[2]) == 0)
+		//check if the directory entry is the requested file, and not one still being written
+		if(strcmp(currentEntry.filename, argv[2]) == 0 &&
+		   !(currentEntry.permissions & QFS_PERM_PENDING))
 		{
-			//save the starting block
-			blockStart = currentEntry.starting_block;
+			//save the entry, the slot tags its tail fragment
+			entryIndex = i;
 			found = 1;
 			break;
 		}
 	}
 	
+	//past the full table, look the name up in the hashed directory, whose
+	//entries tag their tail fragments with a hash of the name
+	if(!found && (sb.flags & QFS_SB_HASHED_DIR))
+	{
+		qfs_dir_t dir;
+		if(qfs_dir_open(&dir, fp, &sb) == 0 && qfs_dir_lock(&dir, F_RDLCK) == 0 &&
+		   qfs_dir_lookup(&dir, argv[2], &currentEntry) > 0 &&
+		   !(currentEntry.permissions & QFS_PERM_PENDING))
+		{
+			entryIndex = qfs_name_tag(currentEntry.filename);
+			found = 1;
+		}
+		qfs_dir_unlock(&dir);
+		qfs_dir_close(&dir);
+	}
+	
 	//prints error message and terminates program if file not found
 	if(!found)
 	{
@@ -67,30 +115,31 @@ int main(int argc, char *argv[]) {
 	//create output file
 	FILE *output = fopen(argv[3], "wb");
 
-	//go to the start block, skipping the is_busy byte
-	fseek(fp, 32 + (255 * 32) + (blockStart * blockSize) + 1, SEEK_SET);
-	int totalBytes = 0;
-	while (totalBytes < currentEntry.file_size)
+	//kernels for this block size copy the data areas out of whole blocks, a
+	//contiguous file is read QFS_RUN_BLOCKS blocks at a time
+	uint8_t *run = malloc(QFS_RUN_BLOCKS * blockSize);
+	uint8_t *data = malloc(QFS_RUN_BLOCKS * (blockSize - 3));
+	qfs_chain_t chain = { fp, direct ? read_direct : NULL, direct, &sb,
+	                      qfs_select_kernels(blockSize), run };
+	qfs_chain_begin(&chain, &currentEntry, entryIndex);
+	long bytes;
+	while ((bytes = qfs_chain_read(&chain, data)) > 0)
 	{
-		//read 1 byte
-		uint8_t buffer;
-		fread(&buffer, sizeof(buffer), 1, fp);
-		
-		//write 1 byte
-		fwrite(&buffer, sizeof(buffer), 1, output);
-		totalBytes++;
-		
-		//check if all data in the block has been read and an advancement to a new block is needed
-		if((totalBytes < currentEntry.file_size) && (totalBytes % (blockSize - 3) == 0))
-		{
-			//read 2 byte next block address
-			uint16_t address;
-			fread(&address, sizeof(address), 1, fp);
-			
-			//seek to the next block address
-			fseek(fp, 32 + (255 * 32) + (address * blockSize) + 1, SEEK_SET);
-		}
+		fwrite(data, bytes, 1, output);
+	}
+	free(data);
+	
+	//the whole chain was read but the shared tail block lost this file's fragment
+	if(bytes < 0 && chain.done == chain.chain_bytes)
+	{
+		printf("TAIL FRAGMENT NOT FOUND.");
+		free(run);
+		fclose(output);
+		fclose(fp);
+		return 1;
 	}
+	free(run);
+	if(direct) qfs_direct_close(direct);
 	
 	//flush written file for safety
 	fflush(output);
@@ -98,5 +147,6 @@ int main(int argc, char *argv[]) {
 	//close files
     fclose(fp);
     fclose(output);
+    qfs_trace_end(&trace, "read", currentEntry.file_size, argv[2]);
     return 0;
 }
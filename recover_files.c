@@ -6,28 +6,113 @@
  * Group: Aleena Graveline, Jean LaFrance, Horacio Valdes, Matthew Glennon
  * Updated by: Jean LaFrance
  * 12/11/2025
+ *
+ * Usage: recover_files [-d] <filesystem_image>
+ *   -d  Read the data blocks with O_DIRECT, bypassing the page cache
+ *
+ * Tail blocks are walked fragment by fragment: a JPEG packed whole into one is
+ * recovered from its fragment, and a chain that ends in one takes the fragment
+ * its directory entry owns. Group descriptor and directory blocks are skipped.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_direct.h"
+
+// No packed file starts at this block
+#define NO_OWNER 0xFFFFFFFF
+
+// Reads one whole block through the O_DIRECT windows when open, stdio otherwise
+static int read_block(FILE *fp, qfs_direct_t *direct, long offset, uint8_t *block, uint16_t size) {
+    if (direct) return qfs_direct_read(direct, offset, block, size);
+    fseek(fp, offset, SEEK_SET);
+    return fread(block, size, 1, fp) == 1 ? 0 : -1;
+}
+
+// Writes a JPEG's data up to and including its end marker (0xFF 0xD9).
+// Returns 1 once the marker has been written.
+static int write_until_end(FILE *output, const uint8_t *data, int length) {
+    for (int j = 0; j < length - 1; j++) {
+        if (data[j] == 0xFF && data[j+1] == 0xD9) {
+            fwrite(data, j + 2, 1, output);
+            return 1;
+        }
+    }
+    fwrite(data, length, 1, output);
+    return 0;
+}
+
+// Opens the next recovered_file_<n>.jpg
+static FILE *open_recovered(int *fileCount) {
+    char outputFileName[32]; // 32 is a bit big for file name but compiler was angry
+    sprintf(outputFileName, "recovered_file_%d.jpg", ++*fileCount);
+    return fopen(outputFileName, "wb");
+}
+
+/*
+** Records the owner tag of the tail fragment of every packed file, indexed by the
+** file's starting block, so a chain that reaches a tail block knows its fragment.
+*/
+static void find_tail_owners(FILE *fp, superblock_t *sb, uint32_t *owners) {
+    direntry_t entry;
+    for (uint32_t i = 0; i < sb->total_blocks; i++) owners[i] = NO_OWNER;
+    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    for (int i = 0; i < sb->total_direntries; i++) {
+        if (fread(&entry, sizeof(direntry_t), 1, fp) != 1) return;
+        if (entry.filename[0] != '\0' && (entry.permissions & QFS_PERM_TAIL) &&
+            entry.starting_block < sb->total_blocks) {
+            owners[entry.starting_block] = (uint16_t)i;
+        }
+    }
+    if (!(sb->flags & QFS_SB_HASHED_DIR)) return;
+
+    qfs_dir_t dir;
+    if (qfs_dir_open(&dir, fp, sb) != 0) return;
+    if (qfs_dir_lock(&dir, F_RDLCK) == 0) {
+        qfs_dir_iter_t iter = {0, 0};
+        while (qfs_dir_next(&dir, &iter, &entry) > 0) {
+            if ((entry.permissions & QFS_PERM_TAIL) && entry.starting_block < sb->total_blocks) {
+                owners[entry.starting_block] = qfs_name_tag(entry.filename);
+            }
+        }
+    }
+    qfs_dir_unlock(&dir);
+    qfs_dir_close(&dir);
+}
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <filesystem_image>\n", argv[0]);
+    int direct_mode = (argc == 3 && strcmp(argv[1], "-d") == 0);
+    if (argc != 2 + direct_mode) {
+        fprintf(stderr, "Usage: %s [-d] <filesystem_image>\n", argv[0]);
         return 1;
     }
+    char *image_name = argv[1 + direct_mode];
 
-    FILE *fp = fopen(argv[1], "rb");
+    FILE *fp = fopen(image_name, "rb");
     if (!fp) {
         perror("fopen");
         return 2;
     }
 
+    qfs_direct_t direct_io;
+    qfs_direct_t *direct = NULL;
+    if (direct_mode) {
+        if (qfs_direct_open(&direct_io, image_name, 0) != 0) {
+            perror("open");
+            fclose(fp);
+            return 2;
+        }
+        direct = &direct_io;
+    }
+
 #ifdef DEBUG
-    printf("Opened disk image: %s\n", argv[1]);
+    printf("Opened disk image: %s\n", image_name);
 #endif
 
     // Read Superblock
@@ -40,23 +125,47 @@ int main(int argc, char *argv[]) {
     // Calculate data start point
     int dataStart = 8192; // superblock size + (total direntries * direntry size)
 
-    // Allocate space for one block minus the header/footer bytes
+    // Allocate space for one whole block; the data area follows the header byte
     int dataSize = sb.bytes_per_block - 3;
-    uint8_t *buffer = malloc(dataSize);
+    uint8_t *block = malloc(sb.bytes_per_block);
+    uint8_t *buffer = block + 1;
+
+    // Which fragment of a tail block belongs to the file starting at each block
+    uint32_t *owners = malloc(sizeof(uint32_t) * sb.total_blocks);
+    find_tail_owners(fp, &sb, owners);
 
     // Iterate through blocks and look for JPEG start
     int fileCount = 0;
     for (int i = 0; i < sb.total_blocks; i++) {
         // Seek to the start of the block
         int currentBlockOffset = dataStart + (i * sb.bytes_per_block);
-        fseek(fp, currentBlockOffset, SEEK_SET);
 
         // Read in bytes
-        uint8_t busyByte;
-        fread(&busyByte, 1, 1, fp);
-        fread(buffer, dataSize, 1, fp);
-        uint16_t nextBytes;
-        fread(&nextBytes, 2, 1, fp);
+        if (read_block(fp, direct, currentBlockOffset, block, sb.bytes_per_block) != 0) break;
+
+        // Group descriptors and the hashed directory never hold file data
+        if (block[0] == QFS_BLOCK_GROUP || block[0] == QFS_BLOCK_DIR) continue;
+
+        // A tail block holds several files' fragments, each after its header
+        if (block[0] == QFS_BLOCK_TAIL) {
+            size_t pos = 0;
+            tailfrag_t frag;
+            while (pos + sizeof(tailfrag_t) <= (size_t)dataSize) {
+                memcpy(&frag, buffer + pos, sizeof(tailfrag_t));
+                if (frag.length == 0) break;
+                uint8_t *fragData = buffer + pos + sizeof(tailfrag_t);
+                if (frag.length >= 2 && fragData[0] == 0xFF && fragData[1] == 0xD8) {
+                    FILE *output = open_recovered(&fileCount);
+                    #ifdef DEBUG
+                        printf("Recovering file %d from a fragment of Block %d...\n", fileCount, i);
+                    #endif
+                    write_until_end(output, fragData, frag.length);
+                    fclose(output);
+                }
+                pos += sizeof(tailfrag_t) + frag.length;
+            }
+            continue;
+        }
 
         // #ifdef DEBUG
         //     if (buffer[0] != 0x00 && buffer[0] != 0x00 && i < 30) {
@@ -66,15 +175,10 @@ int main(int argc, char *argv[]) {
 
         // Check if signature is JPG
         if (buffer[0] == 0xFF && buffer[1] == 0xD8) {
-            fileCount++;
-
-            // Prepare output file
-            char outputFileName[32]; // 32 is a bit big for file name but compiler was angry
-            sprintf(outputFileName, "recovered_file_%d.jpg", fileCount);
-            FILE *output = fopen(outputFileName, "wb");
+            FILE *output = open_recovered(&fileCount);
 
             #ifdef DEBUG
-                printf("Recovering %s from Block %d...\n", outputFileName, i);
+                printf("Recovering file %d from Block %d...\n", fileCount, i);
             #endif
 
             // Look for all block associated with JPG file
@@ -83,27 +187,27 @@ int main(int argc, char *argv[]) {
             while (!isComplete) {
                 // Seek to the offset for current block. Skip header byte
                 int currentOffset = dataStart + (currentBlockIndex * sb.bytes_per_block);
-                fseek(fp, currentOffset, SEEK_SET);
 
-                // Read in bytes
-                uint8_t is_busy;
-                fread(&is_busy, 1, 1, fp);      // Read header
-                fread(buffer, dataSize, 1, fp); // Read data
+                // Read in bytes: header, data, then footer
+                if (read_block(fp, direct, currentOffset, block, sb.bytes_per_block) != 0) break;
                 uint16_t nextBlock;
-                fread(&nextBlock, 2, 1, fp);    // Read footer
-
-                // Find end of jpg signature (0xFF 0xD9)
-                int numBytes = dataSize;
-                for (int j = 0; j < dataSize - 1; j++) {
-                    if (buffer[j] == 0xFF && buffer[j+1] == 0xD9) {
-                        numBytes = j + 2;
-                        isComplete = 1;
-                        break;
+                memcpy(&nextBlock, block + sb.bytes_per_block - 2, 2);
+
+                // A packed file ends in its own fragment of a shared tail block
+                if (block[0] == QFS_BLOCK_TAIL) {
+                    long fragOffset = owners[i] == NO_OWNER ? -1 :
+                        qfs_tail_find(buffer, dataSize, (uint16_t)owners[i]);
+                    if (fragOffset >= 0) {
+                        tailfrag_t frag;
+                        memcpy(&frag, buffer + fragOffset, sizeof(tailfrag_t));
+                        write_until_end(output, buffer + fragOffset + sizeof(tailfrag_t), frag.length);
                     }
+                    break;
                 }
+                if (block[0] == QFS_BLOCK_GROUP || block[0] == QFS_BLOCK_DIR) break;
 
-                // Write data to output file
-                fwrite(buffer, numBytes, 1, output);
+                // Find end of jpg signature (0xFF 0xD9) and write data to output file
+                isComplete = write_until_end(output, buffer, dataSize);
 
                 if (isComplete) break;
 
@@ -117,7 +221,9 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    free(buffer);
+    free(owners);
+    free(block);
+    if (direct) qfs_direct_close(direct);
     fclose(fp);
     return 0;
-}
\ No newline at end of file
+}
@@ -6,25 +6,187 @@
  * Author: Horacio Valdes
  * 12/10/25
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include "qfs.h"
+#include "qfs_dir.h"
+#include "qfs_direct.h"
+#include "qfs_trace.h"
+
+// Blocks gathered for a new file from the allocation groups it has locked
+typedef struct allocation {
+    FILE         *fp;
+    superblock_t *sb;
+    long          data_start;
+    size_t        data_bytes;      // Data area size of one block
+    uint16_t     *blocks;          // Free blocks collected so far
+    size_t        found;           // Number of blocks collected
+    size_t        wanted;          // Number of blocks the file needs
+    uint16_t     *taken;           // Blocks collected from each group
+    int           tail_mode;
+    size_t        tail_len;
+    uint16_t      tail_tag;        // Owner tag of the new fragment
+    long          tail_block;      // Existing tail block with room, or -1
+    size_t        tail_offset;     // Where the new fragment goes in tail_block
+    int           frag_written;    // The fragment has been appended to tail_block
+    int           counted;         // The group descriptors have been updated
+    uint8_t      *buffer;          // Scratch data area
+} allocation_t;
+
+/*
+** Collects free blocks from a locked allocation group until the file has enough.
+** In tail mode the whole group is first searched for a tail block with room for
+** the fragment and no fragment with the same tag. Such a block is used instead
+** of allocating a new one. Returns -1 if the image can't be read.
+*/
+static int scan_group(allocation_t *a, uint32_t group) {
+    uint32_t size = qfs_group_size(a->sb);
+    uint32_t first = group * size;
+    uint32_t end = (a->sb->total_blocks - first < size) ? a->sb->total_blocks : first + size;
+
+    if (a->sb->blocks_per_group) {
+        // A full group can still offer room in one of its tail blocks
+        groupdesc_t desc;
+        fseek(a->fp, a->data_start + ((long)first * a->sb->bytes_per_block) + 1, SEEK_SET);
+        if (fread(&desc, sizeof(groupdesc_t), 1, a->fp) != 1) return -1;
+        first++;
+        if (desc.free_blocks == 0 && !(a->tail_mode && a->tail_block == -1)) return 0;
+    }
+
+    for (uint32_t i = first; i < end && a->tail_mode && a->tail_block == -1; i++) {
+        uint8_t busy_flag;
+        fseek(a->fp, a->data_start + ((long)i * a->sb->bytes_per_block), SEEK_SET);
+        if (fread(&busy_flag, 1, 1, a->fp) != 1) return -1;
+        if (busy_flag != QFS_BLOCK_TAIL) continue;
+
+        if (fread(a->buffer, 1, a->data_bytes, a->fp) != a->data_bytes) return -1;
+        size_t used = qfs_tail_used(a->buffer, a->data_bytes);
+        if (used + sizeof(tailfrag_t) + a->tail_len <= a->data_bytes &&
+            qfs_tail_find(a->buffer, a->data_bytes, a->tail_tag) < 0) {
+            a->tail_block = i;
+            a->tail_offset = used;
+            a->wanted--;
+            // Give back the block that was set aside for a new tail block
+            if (a->found > a->wanted) {
+                a->found--;
+                a->taken[a->blocks[a->found] / size]--;
+            }
+        }
+    }
+
+    for (uint32_t i = first; i < end && a->found < a->wanted; i++) {
+        uint8_t busy_flag;
+        fseek(a->fp, a->data_start + ((long)i * a->sb->bytes_per_block), SEEK_SET);
+        if (fread(&busy_flag, 1, 1, a->fp) != 1) return -1;
+        if (busy_flag == QFS_BLOCK_FREE) {
+            a->blocks[a->found++] = (uint16_t)i;
+            a->taken[group]++;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if a table or hashed directory entry, pending or not, has the name
+static int name_taken(FILE *fp, const superblock_t *sb, qfs_dir_t *dir, const char *name) {
+    direntry_t direntry;
+    fseek(fp, sizeof(superblock_t), SEEK_SET);
+    for (uint8_t i = 0; i < sb->total_direntries; i++) {
+        if (fread(&direntry, sizeof(direntry_t), 1, fp) != 1) return 1;
+        if (qfs_dir_names_match(&direntry, name)) return 1;
+    }
+    return qfs_dir_lookup(dir, name, NULL) != 0;
+}
+
+/*
+** Undoes a write that failed after its name was reserved. The groups it used
+** are locked again in ascending order. The blocks it took are freed, its
+** fragment is taken out of a reused tail block, and the descriptors are given
+** back their counts. Then the groups are released and the pending entry is
+** removed from its slot (still locked) or from the hashed directory.
+*/
+static void back_out(allocation_t *a, const uint8_t *locked, uint32_t group_count,
+                     qfs_dir_t *dir, long slot_offset, const char *name) {
+    superblock_t *sb = a->sb;
+    for (uint32_t g = 0; g < group_count && locked; g++) {
+        if (locked[g]) qfs_lock_group(a->fp, sb, g, F_WRLCK, 1);
+    }
+
+    uint8_t free_flag = QFS_BLOCK_FREE;
+    for (size_t i = 0; i < a->found; i++) {
+        fseek(a->fp, a->data_start + ((long)a->blocks[i] * sb->bytes_per_block), SEEK_SET);
+        fwrite(&free_flag, 1, 1, a->fp);
+    }
+
+    if (a->frag_written && a->tail_block >= 0) {
+        long data_offset = a->data_start + (a->tail_block * sb->bytes_per_block) + 1;
+        fseek(a->fp, data_offset, SEEK_SET);
+        long frag_offset = -1;
+        if (fread(a->buffer, 1, a->data_bytes, a->fp) == a->data_bytes) {
+            frag_offset = qfs_tail_find(a->buffer, a->data_bytes, a->tail_tag);
+        }
+        if (frag_offset >= 0) {
+            qfs_tail_remove(a->buffer, a->data_bytes, frag_offset);
+            fseek(a->fp, data_offset, SEEK_SET);
+            fwrite(a->buffer, 1, a->data_bytes, a->fp);
+        }
+    }
+
+    for (uint32_t g = 0; g < group_count && a->counted && sb->blocks_per_group; g++) {
+        if (a->taken[g] == 0) continue;
+        groupdesc_t desc;
+        long desc_offset = a->data_start + ((long)g * sb->blocks_per_group * sb->bytes_per_block) + 1;
+        fseek(a->fp, desc_offset, SEEK_SET);
+        if (fread(&desc, sizeof(groupdesc_t), 1, a->fp) == 1) {
+            desc.free_blocks += a->taken[g];
+            fseek(a->fp, desc_offset, SEEK_SET);
+            fwrite(&desc, sizeof(groupdesc_t), 1, a->fp);
+        }
+    }
+    for (uint32_t g = 0; g < group_count && locked; g++) {
+        if (locked[g]) qfs_lock_group(a->fp, sb, g, F_UNLCK, 0);
+    }
+
+    if (slot_offset >= 0) {
+        direntry_t empty;
+        memset(&empty, 0, sizeof(empty));
+        fseek(a->fp, slot_offset, SEEK_SET);
+        fwrite(&empty, sizeof(empty), 1, a->fp);
+    } else {
+        if (qfs_dir_lock(dir, F_WRLCK) == 0) qfs_dir_remove(dir, name);
+        qfs_dir_unlock(dir);
+    }
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <disk image file> <file to add>\n", argv[0]);
+    // -t packs the file's final partial block into a shared tail block
+    // -d writes the data blocks with O_DIRECT, bypassing the page cache
+    int tail_mode = 0, direct_mode = 0, arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-t") == 0) tail_mode = 1;
+        else if (strcmp(argv[arg], "-d") == 0) direct_mode = 1;
+        else break;
+    }
+    if (argc - arg != 2 || argv[arg][0] == '-') {
+        fprintf(stderr, "Usage: %s [-t] [-d] <disk image file> <file to add>\n", argv[0]);
         return 1;
     }
+    char *image_name = argv[arg];
+    char *file_name = argv[arg + 1];
+
+    qfs_trace_t trace;
+    qfs_trace_begin(&trace);
 
-    FILE *fp = fopen(argv[1], "rb+");
+    FILE *fp = fopen(image_name, "rb+");
     if (!fp) {
         perror("fopen");
         return 2;
     }
 
-    FILE *src = fopen(argv[2], "rb");
+    FILE *src = fopen(file_name, "rb");
     if (!src) {
         perror("fopen");
         fclose(fp);
@@ -104,29 +266,33 @@ int main(int argc, char *argv[]) {
 
     // Compute required blocks (each block: 1 busy byte, data, 2-byte next pointer)
     size_t data_bytes_per_block = superblock.bytes_per_block - 3;
-    size_t blocks_needed = (file_size == 0) ? 1 :
-        (size_t)((file_size + data_bytes_per_block - 1) / data_bytes_per_block);
 
-    if (superblock.available_direntries == 0) {
-        fprintf(stderr, "No free directory entries available\n");
+    // A packed tail needs room for its fragment header inside one data area
+    size_t tail_len = tail_mode ? qfs_tail_length(file_size, data_bytes_per_block) : 0;
+    if (tail_len == 0) tail_mode = 0;
+    size_t chain_blocks = qfs_chain_blocks(file_size, data_bytes_per_block, tail_mode);
+    size_t blocks_needed = chain_blocks + (tail_mode ? 1 : 0);
+
+    // Quick check against the unlocked counters; a reused tail block saves one
+    if (superblock.available_blocks < blocks_needed - (tail_mode ? 1 : 0)) {
+        fprintf(stderr, "Not enough free blocks available\n");
         fclose(src);
         fclose(fp);
-        return 9;
+        return 10;
     }
 
-    if (superblock.available_blocks < blocks_needed) {
-        fprintf(stderr, "Not enough free blocks available\n");
+    qfs_dir_t dir;
+    if (qfs_dir_open(&dir, fp, &superblock) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
         fclose(src);
         fclose(fp);
-        return 10;
+        return 14;
     }
 
-    // Locate free directory entry and ensure no duplicate name
+    // Ensure no duplicate name
     direntry_t direntry;
-    long free_dir_offset = -1;
     fseek(fp, sizeof(superblock_t), SEEK_SET);
     for (uint8_t i = 0; i < superblock.total_direntries; i++) {
-        long current_offset = ftell(fp);
         if (fread(&direntry, sizeof(direntry_t), 1, fp) != 1) {
             fprintf(stderr, "Failed to read directory entry\n");
             fclose(src);
@@ -134,117 +300,332 @@ int main(int argc, char *argv[]) {
             return 11;
         }
         if (direntry.filename[0] != '\0' &&
-            strncmp(direntry.filename, argv[2], sizeof(direntry.filename)) == 0) {
+            strncmp(direntry.filename, file_name, sizeof(direntry.filename)) == 0) {
             fprintf(stderr, "File already exists in image\n");
             fclose(src);
             fclose(fp);
             return 12;
         }
-        if (direntry.filename[0] == '\0' && free_dir_offset == -1) {
-            free_dir_offset = current_offset;
+    }
+    if (superblock.flags & QFS_SB_HASHED_DIR) {
+        int found = -1;
+        if (qfs_dir_lock(&dir, F_RDLCK) == 0) found = qfs_dir_lookup(&dir, file_name, NULL);
+        qfs_dir_unlock(&dir);
+        if (found != 0) {
+            fprintf(stderr, found > 0 ? "File already exists in image\n" :
+                                        "Failed to read hashed directory\n");
+            fclose(src);
+            fclose(fp);
+            return found > 0 ? 12 : 11;
+        }
+    }
+
+    direntry_t new_entry;
+    memset(&new_entry, 0, sizeof(new_entry));
+    strncpy(new_entry.filename, file_name, sizeof(new_entry.filename) - 1);
+
+    // Claim a free directory entry. A slot is only ours once its bytes are locked
+    // and it still reads as empty. Slots locked by other writers are skipped at
+    // first, then waited for if every free slot was busy.
+    long free_dir_offset = -1;
+    uint16_t tail_tag = 0;
+    for (int wait = 0; wait < 2 && free_dir_offset == -1; wait++) {
+        for (uint8_t i = 0; i < superblock.total_direntries && free_dir_offset == -1; i++) {
+            long current_offset = sizeof(superblock_t) + ((long)i * sizeof(direntry_t));
+            fseek(fp, current_offset, SEEK_SET);
+            if (fread(&direntry, sizeof(direntry_t), 1, fp) != 1) {
+                fprintf(stderr, "Failed to read directory entry\n");
+                fclose(src);
+                fclose(fp);
+                return 11;
+            }
+            if (direntry.filename[0] != '\0') continue;
+            if (qfs_lock(fp, current_offset, sizeof(direntry_t), F_WRLCK, wait) != 0) continue;
+
+            fseek(fp, current_offset, SEEK_SET);
+            if (fread(&direntry, sizeof(direntry_t), 1, fp) == 1 && direntry.filename[0] == '\0') {
+                free_dir_offset = current_offset;
+                tail_tag = i;
+            } else {
+                qfs_lock(fp, current_offset, sizeof(direntry_t), F_UNLCK, 0);
+            }
         }
     }
 
-    if (free_dir_offset == -1) {
-        fprintf(stderr, "No free directory entry found\n");
+    /*
+    ** Reserve the name under the directory lock, so of two writers of the same
+    ** name only one gets past here. The entry is written marked pending into
+    ** the claimed slot or, with the table full, into the hashed directory.
+    ** Only the slot lock is held while waiting for the directory lock, and the
+    ** directory lock is not held while the groups are locked below.
+    */
+    int hashed = (free_dir_offset == -1);
+    new_entry.permissions = QFS_PERM_PENDING;
+    new_entry.starting_block = 0xFFFF;
+    int reserve_rc = qfs_dir_lock(&dir, F_WRLCK);
+    if (reserve_rc == 0 && name_taken(fp, &superblock, &dir, new_entry.filename)) reserve_rc = 12;
+    if (reserve_rc == 0 && hashed && qfs_dir_insert(&dir, &new_entry) != 0) reserve_rc = 13;
+    if (reserve_rc == 0 && !hashed) {
+        fseek(fp, free_dir_offset, SEEK_SET);
+        fwrite(&new_entry, sizeof(new_entry), 1, fp);
+    }
+    qfs_dir_unlock(&dir);
+    if (reserve_rc != 0) {
+        fprintf(stderr, reserve_rc == 12 ? "File already exists in image\n" :
+                                           "No free directory entry found\n");
         fclose(src);
         fclose(fp);
-        return 13;
+        return reserve_rc == 12 ? 12 : 13;
     }
+    if (hashed) tail_tag = qfs_name_tag(new_entry.filename);
 
-    // Collect free blocks
-    uint16_t *blocks = malloc(sizeof(uint16_t) * blocks_needed);
-    if (!blocks) {
+    uint32_t group_count = qfs_group_count(&superblock);
+    allocation_t alloc;
+    memset(&alloc, 0, sizeof(alloc));
+    alloc.fp = fp;
+    alloc.sb = &superblock;
+    alloc.data_start = qfs_data_start(&superblock);
+    alloc.data_bytes = data_bytes_per_block;
+    alloc.tail_mode = tail_mode;
+    alloc.tail_len = tail_len;
+    alloc.tail_tag = tail_tag;
+    alloc.buffer = malloc(data_bytes_per_block);
+    alloc.blocks = malloc(sizeof(uint16_t) * (blocks_needed + 1));
+    alloc.taken = calloc(group_count, sizeof(uint16_t));
+    uint8_t *locked = calloc(group_count, 1);
+    if (!alloc.buffer || !alloc.blocks || !alloc.taken || !locked) {
+        back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
         fprintf(stderr, "Memory allocation failed\n");
         fclose(src);
         fclose(fp);
         return 14;
     }
+    uint8_t *data_buffer = alloc.buffer;
+    long data_region_offset = alloc.data_start;
 
-    size_t found_blocks = 0;
-    long data_region_offset = sizeof(superblock_t) +
-                              (superblock.total_direntries * sizeof(direntry_t));
-    for (uint16_t i = 0; i < superblock.total_blocks && found_blocks < blocks_needed; i++) {
-        long block_offset = data_region_offset + ((long)i * superblock.bytes_per_block);
-        uint8_t busy_flag;
-        fseek(fp, block_offset, SEEK_SET);
-        if (fread(&busy_flag, 1, 1, fp) != 1) {
-            fprintf(stderr, "Failed to read block metadata\n");
-            free(blocks);
-            fclose(src);
-            fclose(fp);
-            return 15;
+    /*
+    ** Lock allocation groups and collect free blocks from them. The first pass
+    ** starts at a group picked by process id so concurrent writers spread out,
+    ** and skips groups another writer holds. Packed files start at group 0
+    ** instead, so small files keep filling the same tail blocks rather than
+    ** opening one in every group. If that isn't enough, every lock is dropped
+    ** and the groups are taken in ascending order, waiting for each one, which
+    ** can't deadlock against another writer doing the same.
+    */
+    uint32_t first_group = tail_mode ? 0 : (uint32_t)getpid() % group_count;
+    for (int wait = 0; wait < 2 && alloc.found < blocks_needed; wait++) {
+        if (wait) {
+            for (uint32_t g = 0; g < group_count; g++) {
+                if (locked[g]) qfs_lock_group(fp, &superblock, g, F_UNLCK, 0);
+                locked[g] = 0;
+                alloc.taken[g] = 0;
+            }
+            alloc.found = 0;
         }
-        if (busy_flag == 0x00) {
-            blocks[found_blocks++] = i;
+        alloc.wanted = blocks_needed;
+        alloc.tail_block = -1;
+
+        for (uint32_t k = 0; k < group_count && alloc.found < alloc.wanted; k++) {
+            uint32_t g = wait ? k : (first_group + k) % group_count;
+            if (qfs_lock_group(fp, &superblock, g, F_WRLCK, wait) != 0) continue;
+            if (scan_group(&alloc, g) != 0) {
+                locked[g] = 1;
+                back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+                fprintf(stderr, "Failed to read block metadata\n");
+                fclose(src);
+                fclose(fp);
+                return 15;
+            }
+            // Keep only the groups this file takes blocks or its tail from
+            uint32_t size = qfs_group_size(&superblock);
+            if (alloc.taken[g] > 0 || (alloc.tail_block >= 0 && alloc.tail_block / size == g)) {
+                locked[g] = 1;
+            } else {
+                qfs_lock_group(fp, &superblock, g, F_UNLCK, 0);
+            }
         }
+        if (alloc.found >= alloc.wanted) break;
     }
 
-    if (found_blocks < blocks_needed) {
+    if (alloc.found < alloc.wanted) {
+        back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
         fprintf(stderr, "Insufficient free data blocks\n");
-        free(blocks);
         fclose(src);
         fclose(fp);
         return 16;
     }
+    blocks_needed = alloc.wanted;
+    uint16_t *blocks = alloc.blocks;
+    size_t found_blocks = alloc.found;
+    long tail_block = alloc.tail_block;
+    size_t tail_offset = alloc.tail_offset;
 
-    uint8_t *data_buffer = malloc(data_bytes_per_block);
-    if (!data_buffer) {
+    // A newly allocated tail block is the last one collected
+    if (tail_mode && tail_block == -1) {
+        tail_block = blocks[--found_blocks];
+        memset(data_buffer, 0, data_bytes_per_block);
+        long block_offset = data_region_offset + (tail_block * superblock.bytes_per_block);
+        fseek(fp, block_offset, SEEK_SET);
+        uint8_t busy = QFS_BLOCK_TAIL;
+        fwrite(&busy, 1, 1, fp);
+        fwrite(data_buffer, 1, data_bytes_per_block, fp);
+        uint16_t next_block = 0xFFFF;
+        fwrite(&next_block, sizeof(uint16_t), 1, fp);
+    }
+    if (tail_mode) blocks[found_blocks] = (uint16_t)tail_block;
+
+    // In direct mode the chain goes through aligned O_DIRECT windows; anything
+    // still buffered in the stream must reach the file before they are read
+    qfs_direct_t direct;
+    if (direct_mode) {
+        fflush(fp);
+        if (qfs_direct_open(&direct, image_name, 1) != 0) {
+            perror("open");
+            back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+            fclose(src);
+            fclose(fp);
+            return 2;
+        }
+    }
+
+    // Write data into blocks, building each whole block (header, data, footer) in memory
+    uint8_t *block = malloc(superblock.bytes_per_block);
+    if (!block) {
+        back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
         fprintf(stderr, "Memory allocation failed\n");
-        free(blocks);
         fclose(src);
         fclose(fp);
         return 17;
     }
-
-    // Write data into blocks
-    size_t remaining = (size_t)file_size;
-    for (size_t idx = 0; idx < blocks_needed; idx++) {
-        memset(data_buffer, 0, data_bytes_per_block);
+    size_t remaining = (size_t)file_size - tail_len;
+    size_t chain_length = tail_mode ? chain_blocks : blocks_needed;
+    for (size_t idx = 0; idx < chain_length; idx++) {
+        memset(block, 0, superblock.bytes_per_block);
         size_t chunk = remaining > data_bytes_per_block ? data_bytes_per_block : remaining;
-        if (chunk > 0 && fread(data_buffer, 1, chunk, src) != chunk) {
+        if (chunk > 0 && fread(block + 1, 1, chunk, src) != chunk) {
+            back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
             fprintf(stderr, "Failed to read from source file\n");
-            free(data_buffer);
-            free(blocks);
             fclose(src);
             fclose(fp);
             return 18;
         }
         remaining -= chunk;
 
+        block[0] = QFS_BLOCK_BUSY;
+        // The last chain block of a packed file points at its tail block
+        uint16_t next_block = (idx + 1 < chain_length || tail_mode) ? blocks[idx + 1] : 0xFFFF;
+        memcpy(block + superblock.bytes_per_block - 2, &next_block, sizeof(uint16_t));
+
         long block_offset = data_region_offset + ((long)blocks[idx] * superblock.bytes_per_block);
-        fseek(fp, block_offset, SEEK_SET);
-        uint8_t busy = 0x01;
-        fwrite(&busy, 1, 1, fp);
-        fwrite(data_buffer, 1, data_bytes_per_block, fp);
-        uint16_t next_block = (idx + 1 < blocks_needed) ? blocks[idx + 1] : 0xFFFF;
-        fwrite(&next_block, sizeof(uint16_t), 1, fp);
+        if (direct_mode) {
+            if (qfs_direct_write(&direct, block_offset, block, superblock.bytes_per_block) != 0) {
+                back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+                fprintf(stderr, "Failed to write block %u\n", blocks[idx]);
+                fclose(src);
+                fclose(fp);
+                return 19;
+            }
+        } else {
+            fseek(fp, block_offset, SEEK_SET);
+            fwrite(block, 1, superblock.bytes_per_block, fp);
+        }
+    }
+    free(block);
+    if (direct_mode && qfs_direct_flush(&direct) != 0) {
+        back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+        fprintf(stderr, "Failed to write data blocks\n");
+        fclose(src);
+        fclose(fp);
+        return 19;
+    }
+
+    // Append the tail fragment to the tail block
+    if (tail_mode) {
+        if (fread(data_buffer, 1, tail_len, src) != tail_len) {
+            back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+            fprintf(stderr, "Failed to read from source file\n");
+            fclose(src);
+            fclose(fp);
+            return 18;
+        }
+        tailfrag_t frag = { tail_tag, (uint16_t)tail_len };
+        long frag_offset = data_region_offset + (tail_block * superblock.bytes_per_block) +
+                           1 + (long)tail_offset;
+        fseek(fp, frag_offset, SEEK_SET);
+        fwrite(&frag, sizeof(tailfrag_t), 1, fp);
+        fwrite(data_buffer, 1, tail_len, fp);
+        alloc.frag_written = 1;
+    }
+
+    // Update the free counts of the groups blocks were taken from
+    for (uint32_t g = 0; g < group_count && superblock.blocks_per_group; g++) {
+        if (alloc.taken[g] == 0) continue;
+        groupdesc_t desc;
+        long desc_offset = data_region_offset +
+                           ((long)g * superblock.blocks_per_group * superblock.bytes_per_block) + 1;
+        fseek(fp, desc_offset, SEEK_SET);
+        if (fread(&desc, sizeof(groupdesc_t), 1, fp) == 1) {
+            desc.free_blocks -= alloc.taken[g];
+            fseek(fp, desc_offset, SEEK_SET);
+            fwrite(&desc, sizeof(groupdesc_t), 1, fp);
+        }
+    }
+    alloc.counted = 1;
+
+    // The blocks are all marked; let other writers have the groups before
+    // waiting for the directory and superblock
+    for (uint32_t g = 0; g < group_count; g++) {
+        if (locked[g]) qfs_lock_group(fp, &superblock, g, F_UNLCK, 0);
     }
 
     // Prepare and write directory entry
-    direntry_t new_entry;
-    memset(&new_entry, 0, sizeof(new_entry));
-    strncpy(new_entry.filename, argv[2], sizeof(new_entry.filename) - 1);
     new_entry.permissions = 0x00;
     if (is_jpg) new_entry.permissions |= 0x40;      //Set file type to 1
     else if (is_png) new_entry.permissions |= 0x80; //Set file type to 2
+    if (tail_mode) new_entry.permissions |= QFS_PERM_TAIL;
     new_entry.owner_id = 0x00;
     new_entry.group_id = 0x00;
     new_entry.starting_block = blocks[0];
     new_entry.file_size = (uint32_t)file_size;
 
-    fseek(fp, free_dir_offset, SEEK_SET);
-    fwrite(&new_entry, sizeof(new_entry), 1, fp);
+    if (hashed) {
+        int rc = qfs_dir_lock(&dir, F_WRLCK);
+        if (rc == 0) rc = qfs_dir_update(&dir, &new_entry);
+        qfs_dir_unlock(&dir);
+        if (rc != 0) {
+            back_out(&alloc, locked, group_count, &dir, free_dir_offset, new_entry.filename);
+            fprintf(stderr, "Failed to write hashed directory entry\n");
+            fclose(src);
+            fclose(fp);
+            return 20;
+        }
+    } else {
+        fseek(fp, free_dir_offset, SEEK_SET);
+        fwrite(&new_entry, sizeof(new_entry), 1, fp);
+    }
 
-    // Update superblock
-    superblock.available_direntries--;
-    superblock.available_blocks -= (uint16_t)blocks_needed;
+    // Update superblock under a short lock, re-reading the counters other
+    // writers may have changed since they were first read
+    qfs_lock(fp, 0, sizeof(superblock_t), F_WRLCK, 1);
     fseek(fp, 0, SEEK_SET);
-    fwrite(&superblock, sizeof(superblock), 1, fp);
+    if (fread(&superblock, sizeof(superblock), 1, fp) == 1) {
+        if (!hashed) superblock.available_direntries--;
+        superblock.available_blocks -= (uint16_t)blocks_needed;
+        fseek(fp, 0, SEEK_SET);
+        fwrite(&superblock, sizeof(superblock), 1, fp);
+    }
+    qfs_lock(fp, 0, sizeof(superblock_t), F_UNLCK, 0);
 
-    free(data_buffer);
-    free(blocks);
+    // Closing the image flushes it and releases the slot lock
+    qfs_dir_close(&dir);
+    free(locked);
+    free(alloc.taken);
+    free(alloc.buffer);
+    free(alloc.blocks);
     fclose(src);
     fclose(fp);
+    // Only closed now, since closing any descriptor of the image drops our locks
+    if (direct_mode) qfs_direct_close(&direct);
+    qfs_trace_end(&trace, "write", (uint64_t)file_size, file_name);
     return 0;
 }